@@ -41,26 +41,78 @@ struct free_chunk {
 };
 
 struct memzone {
-  u64 start;
+  u64 start;      /* phys */
   u64 end;
+  /* per page: PI_FREE | order if page heads a free block in chunks */
+  u8 *pageinfo;
   struct free_chunk chunks[MAX_ORDER+1];
+  /* order 0 pages already zeroed in idle time */
+  struct free_chunk zeroed;
   spinlock_t lock;
 };
 
+#define PREZERO_POOL_MAX    64
+
 static struct memzone memzone;
 
+#define PI_FREE     0x80
+
 static inline u64 page_buddy_pfn(u64 pfn, int order) {
   return pfn ^ (1 << order);
 }
 
+/* NULL if @page is not tracked (early memory before pageallocator_init()) */
+static inline u8 *page_info(struct memzone *z, void *page) {
+  u64 pa = V2P(page);
+
+  if(!z->pageinfo || pa < z->start || pa >= z->end)
+    return NULL;
+
+  return &z->pageinfo[(pa - z->start) >> PAGESHIFT];
+}
+
 static void freelist_add(struct free_chunk *f, void *page) {
   struct header *hp = (struct header *)page;
 
+  hp->prev = NULL;
   hp->next = f->freelist;
+  if(f->freelist)
+    f->freelist->prev = hp;
   f->freelist = hp;
   f->nfree++;
 }
 
+static void freelist_del(struct free_chunk *f, struct header *hp) {
+  if(hp->prev)
+    hp->prev->next = hp->next;
+  else
+    f->freelist = hp->next;
+
+  if(hp->next)
+    hp->next->prev = hp->prev;
+
+  f->nfree--;
+}
+
+static void zone_add_free(struct memzone *z, void *page, int order) {
+  u8 *info = page_info(z, page);
+
+  freelist_add(&z->chunks[order], page);
+  ((struct header *)page)->order = order;
+
+  if(info)
+    *info = PI_FREE | order;
+}
+
+static void zone_del_free(struct memzone *z, void *page, int order) {
+  u8 *info = page_info(z, page);
+
+  freelist_del(&z->chunks[order], page);
+
+  if(info)
+    *info = 0;
+}
+
 static void expand(struct memzone *z, void *page, int order, int page_order) {
   unsigned int size = 1 << page_order;
 
@@ -69,9 +121,7 @@ static void expand(struct memzone *z, void *page, int order, int page_order) {
     size >>= 1;
 
     u8 *p = (u8 *)page + (size << PAGESHIFT);
-    freelist_add(&z->chunks[page_order], p);
-
-    ((struct header *)p)->order = page_order;
+    zone_add_free(z, p, page_order);
   }
 }
 
@@ -83,8 +133,7 @@ static void *__alloc_pages(struct memzone *z, int order) {
       continue;
 
     struct header *p = f->freelist;
-    f->freelist = p->next;
-    f->nfree--;
+    zone_del_free(z, p, i);
 
     expand(z, p, order, i);
 
@@ -95,31 +144,218 @@ static void *__alloc_pages(struct memzone *z, int order) {
   return NULL;
 }
 
-void *alloc_pages(int order) {
+static void *prezeroed_page(struct memzone *z) {
+  struct header *p = z->zeroed.freelist;
+
+  if(p)
+    freelist_del(&z->zeroed, p);
+
+  return p;
+}
+
+/*
+ *  merge with free buddy as far as possible
+ *  freed pages are zeroed on allocation or in idle time
+ */
+static void __free_pages(struct memzone *z, void *pages, int order) {
+  while(order < MAX_ORDER) {
+    u64 pfn = V2P(pages) >> PAGESHIFT;
+    void *buddy = P2V(page_buddy_pfn(pfn, order) << PAGESHIFT);
+    u8 *info = page_info(z, buddy);
+
+    if(!info || *info != (PI_FREE | order))
+      break;
+
+    zone_del_free(z, buddy, order);
+
+    if(buddy < pages)
+      pages = buddy;
+    order++;
+  }
+
+  zone_add_free(z, pages, order);
+}
+
+/*
+ *  per-cpu order 0 page cache
+ *  accessed only by its own cpu with irq disabled
+ */
+struct pcp_cache {
+  struct header *list;
+  int count;
+
+  /* stat */
+  u64 nalloc;
+  u64 nhit;
+  u64 nrefill;
+  u64 ndrain;
+};
+
+#define PCP_BATCH   16
+#define PCP_HIGH    (PCP_BATCH * 4)
+
+static struct pcp_cache pcp_cache[NCPU_MAX];
+
+static void *pcp_pop(struct pcp_cache *c) {
+  struct header *p = c->list;
+
+  if(p) {
+    c->list = p->next;
+    c->count--;
+  }
+
+  return p;
+}
+
+static void pcp_push(struct pcp_cache *c, void *page) {
+  struct header *p = page;
+
+  p->next = c->list;
+  c->list = p;
+  c->count++;
+}
+
+static void pcp_refill(struct pcp_cache *c) {
+  void *p;
+
+  spin_lock(&memzone.lock);
+
+  for(int i = 0; i < PCP_BATCH; i++) {
+    if(!(p = __alloc_pages(&memzone, 0)))
+      break;
+    pcp_push(c, p);
+  }
+
+  spin_unlock(&memzone.lock);
+
+  c->nrefill++;
+}
+
+static void pcp_drain(struct pcp_cache *c, int n) {
+  spin_lock(&memzone.lock);
+
+  while(n-- > 0 && c->list)
+    __free_pages(&memzone, pcp_pop(c), 0);
+
+  spin_unlock(&memzone.lock);
+
+  c->ndrain++;
+}
+
+static void *alloc_page_cpu(int aflags, bool *zeroed) {
+  struct pcp_cache *c;
+  void *p = NULL;
+  u64 flags;
+
+  irqsave(flags);
+
+  /* racy check: don't take zone lock if no prezeroed page */
+  if(!(aflags & ALLOC_NOZERO) && memzone.zeroed.nfree > 0) {
+    spin_lock(&memzone.lock);
+    p = prezeroed_page(&memzone);
+    spin_unlock(&memzone.lock);
+
+    if(p) {
+      *zeroed = true;
+      goto out;
+    }
+  }
+
+  c = &pcp_cache[cpuid()];
+  c->nalloc++;
+
+  if(c->list)
+    c->nhit++;
+  else
+    pcp_refill(c);
+
+  p = pcp_pop(c);
+
+  /* last resort for nozero allocation */
+  if(!p && memzone.zeroed.nfree > 0) {
+    spin_lock(&memzone.lock);
+    *zeroed = (p = prezeroed_page(&memzone)) != NULL;
+    spin_unlock(&memzone.lock);
+  }
+
+out:
+  irqrestore(flags);
+
+  return p;
+}
+
+void *alloc_pages_flags(int order, int aflags) {
   u64 flags = 0;
+  bool zeroed = false;
+  void *p = NULL;
 
   if(order > MAX_ORDER)
     panic("invalid order %d", order);
 
-  spin_lock_irqsave(&memzone.lock, flags);
-
-  void *p = __alloc_pages(&memzone, order);
+  if(order == 0) {
+    p = alloc_page_cpu(aflags, &zeroed);
+  } else {
+    spin_lock_irqsave(&memzone.lock, flags);
+    p = __alloc_pages(&memzone, order);
+    spin_unlock_irqrestore(&memzone.lock, flags);
+  }
 
-  spin_unlock_irqrestore(&memzone.lock, flags);
+  if(!p || (aflags & ALLOC_NOZERO))
+    return p;
 
-  if(p)
+  if(zeroed)
+    memset(p, 0, sizeof(struct header));
+  else
     memset(p, 0, PAGESIZE << order);
 
   return p;
 }
 
-static void __free_pages(struct memzone *z, void *pages, int order) {
-  struct free_chunk *f = &z->chunks[order];
+/*
+ *  zero one free page into prezeroed pool
+ *  called while cpu has nothing to do (e.g. waiting for reply)
+ *  return true if a page was zeroed
+ */
+bool page_prezero_idle() {
+  struct memzone *z = &memzone;
+  struct pcp_cache *c;
+  void *p;
+  u64 flags;
+
+  if(z->zeroed.nfree >= PREZERO_POOL_MAX)
+    return false;
+
+  /* only pages recently freed by this cpu */
+  irqsave(flags);
+  c = &pcp_cache[cpuid()];
+  p = c->count > PCP_BATCH ? pcp_pop(c) : NULL;
+  irqrestore(flags);
+
+  if(!p)
+    return false;
+
+  memset(p, 0, PAGESIZE);
+
+  spin_lock_irqsave(&z->lock, flags);
+  freelist_add(&z->zeroed, p);
+  spin_unlock_irqrestore(&z->lock, flags);
 
-  memset(pages, 0, PAGESIZE << order);
+  return true;
+}
+
+static void free_page_cpu(void *page) {
+  struct pcp_cache *c;
+  u64 flags;
+
+  irqsave(flags);
 
-  freelist_add(f, pages);
-  ((struct header *)pages)->order = order;
+  c = &pcp_cache[cpuid()];
+  pcp_push(c, page);
+
+  if(c->count > PCP_HIGH)
+    pcp_drain(c, PCP_BATCH);
+
+  irqrestore(flags);
 }
 
 void free_pages(void *pages, int order) {
@@ -134,6 +370,11 @@ void free_pages(void *pages, int order) {
   if((u64)pages & ((PAGESIZE << order) - 1))
     panic("alignment %p %d", pages, order);
 
+  if(order == 0) {
+    free_page_cpu(pages);
+    return;
+  }
+
   spin_lock_irqsave(&memzone.lock, flags);
 
   __free_pages(&memzone, pages, order);
@@ -142,10 +383,7 @@ void free_pages(void *pages, int order) {
 }
 
 static void init_free_pages(struct memzone *z, void *pages, int order) {
-  struct free_chunk *f = &z->chunks[order];
-
-  freelist_add(f, pages);
-  ((struct header *)pages)->order = order;
+  zone_add_free(z, pages, order);
 }
 
 void buddydump(void) {
@@ -156,6 +394,18 @@ void buddydump(void) {
     printf("order %d %p %p(->%p) nfree %d\n",
            i, f, f->freelist, f->freelist ? f->freelist->next : NULL, f->nfree);
   }
+  printf("prezeroed nfree %d\n", memzone.zeroed.nfree);
+
+  for(int i = 0; i < NCPU_MAX; i++) {
+    struct pcp_cache *c = &pcp_cache[i];
+
+    if(!c->nalloc && !c->count)
+      continue;
+
+    printf("cpu%d pcp: count %d alloc %d hit %d(%d%%) refill %d drain %d\n",
+           i, c->count, c->nalloc, c->nhit, c->nalloc ? c->nhit * 100 / c->nalloc : 0,
+           c->nrefill, c->ndrain);
+  }
 }
 
 static void pageallocator_test() {
@@ -205,6 +455,11 @@ void pageallocator_init() {
   struct memblock *mem;
   int nslot = system_memory.nslot;
   int total = 0;
+  u64 infosize, infodone = 0;
+
+  memzone.start = system_memory_base();
+  memzone.end = system_memory_end();
+  infosize = (memzone.end - memzone.start) >> PAGESHIFT;
 
   for(mem = system_memory.slots; mem < &system_memory.slots[nslot]; mem++) {
     u64 pstart = mem->phys_start;
@@ -214,6 +469,28 @@ void pageallocator_init() {
       if(is_reserved(pstart + s))
         continue;
 
+      /* first free blocks hold pageinfo[]; free the unused tail of the last one */
+      if(infodone < infosize) {
+        u8 *p = P2V(pstart + s);
+        u64 n = min(infosize - infodone, (u64)PAGESIZE << MAX_ORDER);
+        int order = 0;
+
+        if(!memzone.pageinfo)
+          memzone.pageinfo = p;
+        else if(p != memzone.pageinfo + infodone)
+          panic("pageinfo");
+
+        while((PAGESIZE << order) < n)
+          order++;
+
+        memset(p, 0, PAGESIZE << order);
+        infodone += n;
+
+        /* only the last one has a tail: pageinfo[] covers it already */
+        expand(&memzone, p, order, MAX_ORDER);
+        continue;
+      }
+
       init_free_pages(&memzone, P2V(pstart + s), MAX_ORDER);
 
       total++;
@@ -19,6 +19,7 @@
 #include "iomem.h"
 #include "arch-timer.h"
 #include "panic.h"
+#include "objpool.h"
 
 #define KiB   (1024)
 #define MiB   (1024 * 1024)
@@ -86,6 +87,8 @@ int vmm_init_cpu0(void *fdt_phys) {
 
   pageallocator_init();
 
+  objpool_sysinit();
+
   psci_init();
 
   pcpu_init();
@@ -5,6 +5,7 @@
 #include "vcpu.h"
 #include "pcpu.h"
 #include "localnode.h"
+#include "vsm.h"
 #include "panic.h"
 
 struct irq irqlist[NIRQ];
@@ -56,9 +57,18 @@ void irq_entry(int from_guest) {
 
   irq_exit();
 
-  if(!msg_queue_empty(&mycpu->recv_waitq) && !in_interrupt() && local_lazyirq_enabled()) {
+  if(in_interrupt() || !local_lazyirq_enabled())
+    return;
+
+  if(!msg_queue_empty(&mycpu->recv_waitq))
     do_recv_waitqueue();
-  }
+
+  msg_async_timeout_check();
+
+  /* hyp timer is armed for the next lease running out */
+  lazyirq_enter();
+  vsm_lease_expire();
+  lazyirq_exit();
 }
 
 void irqstats() {
@@ -6,6 +6,8 @@
 #include "panic.h"
 #include "lib.h"
 #include "compiler.h"
+#include "param.h"
+#include "aarch64.h"
 
 static void __malloc_test() __unused;
 
@@ -13,30 +15,47 @@ static const u32 blocksize[8] = {
   16, 32, 64, 128, 248, 504, 1016, 2040
 };
 
+#define NCLASS      8
+
 struct mhdr {
   struct mhdr *next;
 };
 
+/* a slab: header and blocks of one size class in a page */
 struct frame {
-  struct frame *next;
+  struct frame *next, *prev;    /* partial list */
   struct mhdr *freelist;
+  u16 inuse;
+  u8 class;
+  bool partial;
 };
 
 struct chunk {
-  struct frame *framelist;
+  struct frame *partial;    /* frames having free blocks */
+  spinlock_t lock;
 };
 
-static struct chunk malloc_chunk[8];
-static spinlock_t heaplock = SPINLOCK_INIT;
+/*
+ *  per-cpu magazine of free blocks
+ *  accessed only by its own cpu with irq disabled
+ */
+#define MAG_SIZE    16
+#define MAG_BATCH   (MAG_SIZE / 2)
 
-static inline int chunk_order(struct chunk *c) {
-  return c - malloc_chunk;
-}
+struct magazine {
+  void *obj[MAG_SIZE];
+  int n;
+};
+
+static struct chunk malloc_chunk[NCLASS] = {
+  [0 ... NCLASS-1] = { .partial = NULL, .lock = SPINLOCK_INIT },
+};
+static struct magazine magazine[NCPU_MAX][NCLASS];
 
 static int get_order(u32 size) {
   int order = 0;
 
-  while(order < 9) {
+  while(order < NCLASS) {
     if(size <= blocksize[order])
       break;
     order++;
@@ -48,12 +67,15 @@ static int get_order(u32 size) {
 static struct frame *malloc_frame(int order) {
   struct mhdr *freelist = NULL;
   u32 bsize = blocksize[order];
-  struct frame *f = alloc_page();
+  struct frame *f = alloc_page_nozero();
 
   if(!f)
     return NULL;
 
-  f->next = NULL;
+  f->next = f->prev = NULL;
+  f->inuse = 0;
+  f->class = order;
+  f->partial = false;
 
   for(u64 maddr = (u64)f + sizeof(struct frame); maddr + bsize < (u64)f + PAGESIZE;
       maddr += bsize) {
@@ -66,73 +88,143 @@ static struct frame *malloc_frame(int order) {
   return f;
 }
 
-static void *__malloc(struct chunk *chunk, u32 size) {
-  struct frame *framelist = chunk->framelist;
+static void partial_add(struct chunk *c, struct frame *f) {
+  f->prev = NULL;
+  f->next = c->partial;
+  if(c->partial)
+    c->partial->prev = f;
+  c->partial = f;
+  f->partial = true;
+}
+
+static void partial_del(struct chunk *c, struct frame *f) {
+  if(f->prev)
+    f->prev->next = f->next;
+  else
+    c->partial = f->next;
+
+  if(f->next)
+    f->next->prev = f->prev;
+
+  f->partial = false;
+}
+
+/* called with c->lock held */
+static void *slab_alloc(struct chunk *c) {
+  struct frame *f = c->partial;
+  struct mhdr *mem;
+
+  if(!f) {
+    if(!(f = malloc_frame(c - malloc_chunk)))
+      return NULL;
 
-  if(!framelist) {   /* first call of malloc */
-    framelist = chunk->framelist = malloc_frame(chunk_order(chunk));
+    partial_add(c, f);
   }
 
-retry:
-  for(struct frame *f = framelist; f; f = f->next) {
-    struct mhdr *mem = f->freelist;
-    if(mem) {
-      f->freelist = mem->next;
-      memset(mem, 0, size);
-      return (void *)mem;
-    }
+  mem = f->freelist;
+  f->freelist = mem->next;
+  f->inuse++;
+
+  if(!f->freelist)
+    partial_del(c, f);
+
+  return mem;
+}
+
+/* called with c->lock held */
+static void slab_free(struct chunk *c, void *ptr) {
+  struct frame *f = (struct frame *)PAGE_ADDRESS(ptr);
+  struct mhdr *mem = ptr;
+
+  mem->next = f->freelist;
+  f->freelist = mem;
+  f->inuse--;
+
+  if(!f->partial)
+    partial_add(c, f);
+
+  /* return empty frame to page allocator, but keep the last one */
+  if(f->inuse == 0 && (f->prev || f->next)) {
+    partial_del(c, f);
+    free_page(f);
   }
+}
 
-  /* add framelist */
-  struct frame *newframe = malloc_frame(chunk_order(chunk));
-  if(!newframe)
-    return NULL;
+static void mag_refill(struct magazine *m, struct chunk *c) {
+  void *p;
+
+  spin_lock(&c->lock);
+
+  while(m->n < MAG_BATCH && (p = slab_alloc(c)) != NULL)
+    m->obj[m->n++] = p;
+
+  spin_unlock(&c->lock);
+}
+
+static void mag_drain(struct magazine *m, struct chunk *c) {
+  spin_lock(&c->lock);
 
-  newframe->next = framelist;
-  framelist = chunk->framelist = newframe;
+  while(m->n > MAG_BATCH)
+    slab_free(c, m->obj[--m->n]);
 
-  goto retry;
+  spin_unlock(&c->lock);
 }
 
 void *malloc(u32 size) {
+  struct magazine *m;
+  void *p = NULL;
   u64 flags = 0;
 
   if(size == 0)
     panic("0 malloc");
 
   int order = get_order(size);
-  if(order >= 8)
+  if(order >= NCLASS)
     panic("too big: %d", size);
 
-  struct chunk *chunk = &malloc_chunk[order];
+  irqsave(flags);
+
+  m = &magazine[cpuid()][order];
+
+  if(m->n == 0)
+    mag_refill(m, &malloc_chunk[order]);
 
-  spin_lock_irqsave(&heaplock, flags);
+  if(m->n > 0)
+    p = m->obj[--m->n];
 
-  void *p = __malloc(chunk, size);
+  irqrestore(flags);
 
-  spin_unlock_irqrestore(&heaplock, flags);
+  if(!p)
+    return NULL;
 
   if((u64)p & 0x7)
     panic("malloc: not aligned to 8 byte: %p", p);
 
+  memset(p, 0, size);
+
   return p;
 }
 
 void free(void *ptr) {
+  struct frame *frame;
+  struct magazine *m;
   u64 flags = 0;
 
   if(!ptr)
     panic("null free");
 
-  struct frame *frame = (struct frame *)PAGE_ADDRESS(ptr);
+  frame = (struct frame *)PAGE_ADDRESS(ptr);
+
+  irqsave(flags);
+
+  m = &magazine[cpuid()][frame->class];
 
-  spin_lock_irqsave(&heaplock, flags);
+  if(m->n == MAG_SIZE)
+    mag_drain(m, &malloc_chunk[frame->class]);
 
-  struct mhdr *free_mem = ptr;
-  free_mem->next = frame->freelist;
-  frame->freelist = free_mem;
+  m->obj[m->n++] = ptr;
 
-  spin_unlock_irqrestore(&heaplock, flags);
+  irqrestore(flags);
 }
 
 static void __malloc_test() {
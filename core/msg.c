@@ -9,6 +9,7 @@
 #include "net.h"
 #include "pcpu.h"
 #include "mm.h"
+#include "s2mm.h"
 #include "spinlock.h"
 #include "ethernet.h"
 #include "msg.h"
@@ -17,6 +18,8 @@
 #include "panic.h"
 #include "assert.h"
 #include "arch-timer.h"
+#include "objpool.h"
+#include "virtq.h"
 
 #define USE_SCATTER_GATHER
 
@@ -28,6 +31,9 @@ extern struct msg_handler_data __msg_handler_data_end[];
 
 static struct msg_data msg_data[NUM_MSG];
 
+/* received msg: at most a whole rx ring in flight per node */
+static DEFINE_OBJPOOL(msg_pool, struct msg, NQUEUE * NR_NODE);
+
 static char *msmap[NUM_MSG] = {
   [MSG_NONE]            "msg:none",
   [MSG_INIT]            "msg:init",
@@ -48,6 +54,8 @@ static char *msmap[NUM_MSG] = {
   [MSG_SGI]             "msg:sgi",
   [MSG_PANIC]           "msg:panic",
   [MSG_BOOT_SIG]        "msg:boot_sig",
+  [MSG_FETCH_BATCH]     "msg:fetch_batch",
+  [MSG_MANAGER]         "msg:manager",
 };
 
 static inline u32 msg_hdr_size(struct msg *msg) {
@@ -115,13 +123,172 @@ void msg_free(struct msg *msg) {
   assert(msg);
 
   free_iobuf(msg->data);
-  free(msg);
+  objpool_free(&msg_pool, msg);
+}
+
+static struct msg_pending *msg_pending_alloc(u32 connectionid, bool async, u32 nreply,
+                                             void (*reply_cb)(struct msg *, void *),
+                                             void *cb_arg) {
+  struct msg_pending *p;
+  u64 flags;
+
+  irqsave(flags);
+
+  for(p = current->outstanding; p < &current->outstanding[NR_MSG_PENDING]; p++) {
+    if(!p->used) {
+      p->used = true;
+      p->async = async;
+      p->nreply = nreply;
+      p->connectionid = connectionid;
+      p->reply = NULL;
+      p->reply_cb = reply_cb;
+      p->cb_arg = cb_arg;
+      p->deadline = async ? now_cycles() + usec_to_cycles(MSG_REPLY_TIMEOUT_US) : 0;
+
+      if(async)
+        current->nasync++;
+
+      irqrestore(flags);
+      return p;
+    }
+  }
+
+  irqrestore(flags);
+
+  /* async request can be dropped by caller */
+  if(async)
+    return NULL;
+
+  panic("too many outstanding requests");
+}
+
+static void msg_pending_free(struct msg_pending *p) {
+  if(p->async)
+    current->nasync--;
+
+  p->reply = NULL;
+  p->used = false;
+}
+
+/*
+ *  nobody waits for replies of async requests: a lost one would keep
+ *  pages locked by the requester forever.  fail the request instead:
+ *  reply_cb gets NULL once, and replies arriving later are stale.
+ *  called at the tail of irq
+ */
+void msg_async_timeout_check() {
+  struct msg_pending *p;
+  void (*reply_cb)(struct msg *, void *);
+  void *cb_arg;
+  u64 now;
+
+  /* irq before the vcpu is set up */
+  if(!current || !current->nasync)
+    return;
+
+  assert(local_irq_disabled());
+
+  now = now_cycles();
+
+  lazyirq_enter();
+
+  for(p = current->outstanding; p < &current->outstanding[NR_MSG_PENDING]; p++) {
+    if(!p->used || !p->async || now < p->deadline)
+      continue;
+
+    vmm_warn("msg: %d replies to %p timed out\n", p->nreply, p->connectionid);
+
+    reply_cb = p->reply_cb;
+    cb_arg = p->cb_arg;
+    msg_pending_free(p);
+
+    /* as recv_reply() from do_recv_waitqueue() */
+    local_irq_enable();
+    reply_cb(NULL, cb_arg);
+    local_irq_disable();
+  }
+
+  lazyirq_exit();
+}
+
+static struct msg_pending *msg_pending_lookup(u32 connectionid) {
+  struct msg_pending *p;
+
+  for(p = current->outstanding; p < &current->outstanding[NR_MSG_PENDING]; p++) {
+    if(p->used && p->connectionid == connectionid)
+      return p;
+  }
+
+  return NULL;
+}
+
+static void recv_reply(struct msg *reply) {
+  struct msg_pending *p = msg_pending_lookup(msg_connid(reply));
+
+  if(!p) {
+    vmm_warn("stale reply %s %p\n", msmap[reply->hdr->type], msg_connid(reply));
+    msg_free(reply);
+    return;
+  }
+
+  if(p->reply)
+    panic("reply twice %p", msg_connid(reply));
+
+  if(p->async) {
+    p->reply_cb(reply, p->cb_arg);
+
+    msg_free(reply);
+
+    if(--p->nreply == 0)
+      msg_pending_free(p);
+    return;
+  }
+
+  p->reply = reply;
 }
 
-static void set_reply_buf(struct msg *reply) {
-  assert(!current->reply_buf);
+/*
+ *  sleep until the reply to @p arrives
+ *  replies are delivered by do_recv_waitqueue() at the tail of irq,
+ *  so the cpu sleeps in wfi until rx irq or SGI_DO_RECVQ wakes it up
+ */
+static struct msg *msg_wait_reply(struct msg_pending *p) {
+  struct msg *reply;
+  u64 flags;
+  u64 deadline = now_cycles() + usec_to_cycles(MSG_REPLY_TIMEOUT_US);
+
+  if(in_lazyirq())
+    panic("wait reply in lazyirq: never delivered");
+
+  irqsave(flags);
+
+  /* guarantee a wakeup even if the reply is lost */
+  hyp_timer_arm(HYP_TIMER_MSG, deadline);
+
+  while((reply = p->reply) == NULL) {
+    if(now_cycles() >= deadline)
+      panic("deadlock? no reply to %p", p->connectionid);
+
+    /*
+     *  spend round trip time on zeroing free pages, one page at a time:
+     *  a reply arrived meanwhile is taken before zeroing the next one
+     */
+    if(local_irq_pending() || !page_prezero_idle())
+      wfi();
 
-  current->reply_buf = reply;
+    /* handle pending irq here */
+    local_irq_enable();
+    isb();
+    local_irq_disable();
+  }
+
+  hyp_timer_disarm(HYP_TIMER_MSG);
+
+  msg_pending_free(p);
+
+  irqrestore(flags);
+
+  return reply;
 }
 
 void do_recv_waitqueue() {
@@ -167,7 +334,7 @@ restart:
 
       msg_free(m);
     } else {          // reply msg type
-      set_reply_buf(m);
+      recv_reply(m);
     }
   }
 
@@ -179,12 +346,15 @@ restart:
   if(!msg_queue_empty(recvq))
     goto restart;
 
+  /* stage 2 updates by handlers above */
+  s2_tlb_flush_gathered();
+
   lazyirq_exit();
 }
 
 /* called by hardware rx irq */
 int msg_recv(u8 *src_mac, struct iobuf *buf) {
-  struct msg *msg = malloc(sizeof(*msg));
+  struct msg *msg = objpool_alloc(&msg_pool);
   int rc = 0;
   u32 body_len = 0;
   void *body = NULL;
@@ -193,6 +363,9 @@ int msg_recv(u8 *src_mac, struct iobuf *buf) {
   struct msg_header *hdr = buf->data;
   msg->hdr = hdr;
   msg->data = buf;
+  msg->body = NULL;
+  msg->body_len = 0;
+  msg->body_free = NULL;
 
   // printf("msg recv %d %p\n", buf->len);
   // bin_dump(buf->data, 128);
@@ -201,16 +374,20 @@ int msg_recv(u8 *src_mac, struct iobuf *buf) {
   if(buf->len > 64) {
     body = buf->data + 50;
     body_len = buf->len - 54;
-  } else if(buf->body) {
-    body = buf->body;
-    body_len = buf->body_len;
+  } else if(buf->body && buf->body_len) {
+    /* Packet 2: take over rx body pages, already cleaned to PoC by driver */
+    msg->body = iobuf_take_body(buf);
+    msg->body_len = buf->body_len;
   }
 
-  /* Packet 2 */
+  /* body inlined in Packet 1 */
   if(body) {
+    if(body_len > MSG_BODY_MAX)
+      panic("msg: body too big %d", body_len);
+
     msg->body_len = body_len;
 
-    msg->body = alloc_page();
+    msg->body = alloc_pages_nozero(body_len > PAGESIZE ? 1 : 0);
     memcpy(msg->body, body, body_len);
 
     dcache_flush_poc_range(msg->body, body_len);
@@ -260,6 +437,8 @@ static inline void __msginitcore(struct msg *msg, u16 dst_id, enum msgtype type,
   msg->dst_id = dst_id;
   msg->body = body;
   msg->body_len = body_len;
+  msg->nreply = 1;
+  msg->body_free = NULL;
 }
 
 void __msg_init(struct msg *msg, u16 dst_id, enum msgtype type,
@@ -267,6 +446,11 @@ void __msg_init(struct msg *msg, u16 dst_id, enum msgtype type,
   __msginitcore(msg, dst_id, type, hdr, body, body_len, new_connection(reqcpu));
 }
 
+void __msg_init_conn(struct msg *msg, u16 dst_id, enum msgtype type,
+                     struct msg_header *hdr, void *body, int body_len, u32 connid) {
+  __msginitcore(msg, dst_id, type, hdr, body, body_len, connid);
+}
+
 void __msg_reply(struct msg *msg, enum msgtype type,
                  struct msg_header *hdr, void *body, int body_len) {
   struct msg reply;
@@ -276,10 +460,22 @@ void __msg_reply(struct msg *msg, enum msgtype type,
   send_msg(&reply);
 }
 
-void __send_msg(struct msg *msg, void (*reply_cb)(struct msg *, void *),
-                void *cb_arg, int flags) {
+int __send_msg(struct msg *msg, void (*reply_cb)(struct msg *, void *),
+               void *cb_arg, int flags) {
+  struct msg_pending *pending = NULL;
+  bool async = !!(flags & M_ASYNC);
   u8 *dst_mac;
 
+  /* register before sending: reply may come back before ether_send_packet() returns */
+  if(reply_cb) {
+    if(!async && msg->nreply != 1)
+      panic("multiple replies need M_ASYNC");
+
+    pending = msg_pending_alloc(msg_connid(msg), async, msg->nreply, reply_cb, cb_arg);
+    if(!pending)
+      return -1;
+  }
+
   if(flags & M_BCAST) {
     dst_mac = bcast_mac;
   } else {
@@ -292,30 +488,37 @@ void __send_msg(struct msg *msg, void (*reply_cb)(struct msg *, void *),
   memcpy((u8 *)buf->data, msg->hdr, msg_hdr_size(msg));
 
   if(msg->body) {
-    buf->body = alloc_page();
-    memcpy(buf->body, msg->body, msg->body_len);
-    buf->body_len = msg->body_len;
+    if(msg->body_len > msg_body_max())
+      panic("msg: body too big %d > %d", msg->body_len, msg_body_max());
+
+    if(msg->body_free) {
+      /* zero copy */
+      buf->body = msg->body;
+      buf->body_len = msg->body_len;
+      buf->body_free = msg->body_free;
+    } else {
+      iobuf_alloc_body(buf, msg->body_len);
+      memcpy(buf->body, msg->body, msg->body_len);
+    }
   }
 
   // printf("send msg %s\n", msmap[msg->hdr->type]);
 
   ether_send_packet(localnode.nic, dst_mac, type, buf);
 
-  if(reply_cb) {
-    struct msg *reply;
-    int timeout_us = 200000;
-    
-    while((reply = current->reply_buf) == NULL && timeout_us--)
-      usleep(1);
-
-    if(current->reply_buf == NULL)
-      panic("deadlock?");
-    current->reply_buf = NULL;
+  if(reply_cb && !async) {
+    struct msg *reply = msg_wait_reply(pending);
 
     reply_cb(reply, cb_arg);
 
     msg_free(reply);
   }
+
+  return 0;
+}
+
+u32 msg_body_max() {
+  return msg_body_max_mtu(localnode.nic->mtu);
 }
 
 void msg_sysinit() {
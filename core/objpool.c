@@ -0,0 +1,173 @@
+/*
+ *  typed object pool with per-cpu freelists
+ */
+
+#include "types.h"
+#include "objpool.h"
+#include "allocpage.h"
+#include "malloc.h"
+#include "spinlock.h"
+#include "aarch64.h"
+#include "mm.h"
+#include "lib.h"
+#include "log.h"
+#include "panic.h"
+
+extern struct objpool *__objpool_start[], *__objpool_end[];
+
+#define POOL_BATCH      16
+#define POOL_CPU_HIGH   (POOL_BATCH * 2)
+
+struct poolobj {
+  struct poolobj *next;
+};
+
+static inline bool pool_owns(struct objpool *pool, void *obj) {
+  return pool->start <= obj && obj < pool->end;
+}
+
+static inline int size_order(u64 size) {
+  int order = 0;
+
+  while((PAGESIZE << order) < size)
+    order++;
+
+  return order;
+}
+
+static void objpool_init(struct objpool *pool) {
+  u32 size = ALIGN_UP(max(pool->objsize, sizeof(struct poolobj)), 8);
+  u64 total = (u64)size * pool->nobj;
+  struct poolobj *obj;
+  u8 *p;
+
+  p = alloc_pages(size_order(total));
+  if(!p)
+    panic("objpool %s: no memory", pool->name);
+
+  pool->objsize = size;
+  pool->start = p;
+  pool->end = p + total;
+
+  for(; p < (u8 *)pool->end; p += size) {
+    obj = (struct poolobj *)p;
+    obj->next = pool->shared;
+    pool->shared = obj;
+    pool->nshared++;
+  }
+}
+
+/* move up to POOL_BATCH objects from shared list */
+static void pool_refill(struct objpool *pool, struct objpool_cpu *c) {
+  struct poolobj *obj;
+
+  spin_lock(&pool->lock);
+
+  while(c->nfree < POOL_BATCH && (obj = pool->shared) != NULL) {
+    pool->shared = obj->next;
+    pool->nshared--;
+
+    obj->next = c->freelist;
+    c->freelist = obj;
+    c->nfree++;
+  }
+
+  spin_unlock(&pool->lock);
+}
+
+static void pool_drain(struct objpool *pool, struct objpool_cpu *c) {
+  struct poolobj *obj;
+
+  spin_lock(&pool->lock);
+
+  while(c->nfree > POOL_BATCH) {
+    obj = c->freelist;
+    c->freelist = obj->next;
+    c->nfree--;
+
+    obj->next = pool->shared;
+    pool->shared = obj;
+    pool->nshared++;
+  }
+
+  spin_unlock(&pool->lock);
+}
+
+void *objpool_alloc(struct objpool *pool) {
+  struct objpool_cpu *c;
+  struct poolobj *obj;
+  u64 flags;
+
+  irqsave(flags);
+
+  c = &pool->cpu[cpuid()];
+
+  if(!c->freelist)
+    pool_refill(pool, c);
+
+  obj = c->freelist;
+  if(obj) {
+    c->freelist = obj->next;
+    c->nfree--;
+  } else {
+    pool->nfallback++;
+  }
+
+  irqrestore(flags);
+
+  if(!obj)
+    return malloc(pool->objsize);
+
+  memset(obj, 0, pool->objsize);
+
+  return obj;
+}
+
+void objpool_free(struct objpool *pool, void *obj) {
+  struct objpool_cpu *c;
+  struct poolobj *o = obj;
+  u64 flags;
+
+  if(!obj)
+    panic("objpool %s: null free", pool->name);
+
+  if(!pool_owns(pool, obj)) {
+    /* allocated by fallback */
+    free(obj);
+    return;
+  }
+
+  irqsave(flags);
+
+  c = &pool->cpu[cpuid()];
+
+  o->next = c->freelist;
+  c->freelist = o;
+  c->nfree++;
+
+  if(c->nfree > POOL_CPU_HIGH)
+    pool_drain(pool, c);
+
+  irqrestore(flags);
+}
+
+void objpool_dump() {
+  struct objpool **pp;
+
+  for(pp = __objpool_start; pp < __objpool_end; pp++) {
+    struct objpool *pool = *pp;
+
+    printf("objpool %s: objsize %d nobj %d shared %d fallback %d\n",
+           pool->name, pool->objsize, pool->nobj, pool->nshared, pool->nfallback);
+  }
+}
+
+void objpool_sysinit() {
+  struct objpool **pp;
+
+  for(pp = __objpool_start; pp < __objpool_end; pp++) {
+    objpool_init(*pp);
+
+    vmm_log("objpool %s: %d x %d byte\n", (*pp)->name, (*pp)->nobj, (*pp)->objsize);
+  }
+}
@@ -70,6 +70,8 @@ void panic(const char *fmt, ...) {
 
   irqstats();
 
+  vsm_logdump(16);
+
   vcpu_dump(current);
   node_cluster_dump();
 
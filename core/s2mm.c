@@ -15,16 +15,268 @@
 #include "panic.h"
 #include "tlb.h"
 #include "assert.h"
+#include "spinlock.h"
 
 int s2_root_level;
 u64 *vttbr;
 
+bool tlbi_range_supported;
+
+/* serialize block splitting and table creation against lookups */
+static spinlock_t s2_split_lock = SPINLOCK_INIT;
+
+/* serialize setting/clearing contiguous hint */
+static spinlock_t s2_cont_lock = SPINLOCK_INIT;
+
+/*
+ *  stage 2 tlb gather
+ *  pte updates of one fault or one batch of messages only record their
+ *  ipa here, and s2_tlb_flush_gathered() issues all tlbi under one set of
+ *  barriers before the guest resumes or before a reply depending on it
+ *  is sent.  pages unmapped meanwhile are freed after the flush.
+ */
+#define S2_GATHER_NRANGE    4
+#define S2_GATHER_NFREE     8
+
+struct s2_tlb_gather {
+  int nrange;
+  bool all;
+  struct {
+    u64 start;
+    u64 end;
+  } range[S2_GATHER_NRANGE];
+  int nfree;
+  struct {
+    void *page;
+    void (*free)(void *);
+  } freed[S2_GATHER_NFREE];
+};
+
+static struct s2_tlb_gather s2_gather[NCPU_MAX];
+
+#define LEVEL_SHIFT(level)    (39 - (level) * 9)
+#define LEVEL_SIZE(level)     (1ul << LEVEL_SHIFT(level))
+
+/* entries of root table: more than 512 if concatenated */
+static u64 s2_root_entries;
+
+static inline u64 *s2_entry(u64 *pgt, int level, ipa_t ipa) {
+  if(level == s2_root_level)
+    return &pgt[(ipa >> LEVEL_SHIFT(level)) & (s2_root_entries - 1)];
+  else
+    return &pgt[PIDX(level, ipa)];
+}
+
+/*
+ *  per-cpu cache of level 3 tables keyed by ipa >> 21
+ *  stage 2 tables are never freed, so a cached table never goes stale
+ */
+#define S2_WALK_CACHE_SIZE    8
+
+struct s2_walk_cache {
+  struct {
+    u64 key;
+    u64 *table;
+  } ent[S2_WALK_CACHE_SIZE];
+};
+
+static struct s2_walk_cache s2_walk_cache[NCPU_MAX];
+
+static inline bool pte_is_block(u64 pte, int level) {
+  return level < 3 && (pte & PTE_VALID) && !(pte & PTE_TABLE);
+}
+
+/*
+ *  split block mapping into next level table with the same attribute
+ *  break-before-make: guest faults on it meanwhile and waits for s2_split_lock
+ */
+static void s2_split_block(u64 *pte, int level, ipa_t ipa) {
+  u64 *table = alloc_page_nozero();
+  u64 e = *pte;
+  u64 attr = e & ~(PTE_PA(~0ul) | PTE_V);
+  u64 type = level + 1 == 3 ? PTE_V : PTE_VALID;
+
+  if(!table)
+    panic("split block");
+
+  /* writable local memory: keep 64KB runs in one tlb entry */
+  if(level + 1 == 3 && (e & S2PTE_S2AP_MASK) == S2PTE_RW)
+    type |= S2PTE_CONT;
+
+  for(int i = 0; i < 512; i++)
+    table[i] = (PTE_PA(e) + ((u64)i << LEVEL_SHIFT(level + 1))) | attr | type;
+
+  dsb(ishst);
+
+  *pte = 0;
+  tlb_s2_flush_range(ALIGN_DOWN(ipa, LEVEL_SIZE(level)), LEVEL_SIZE(level));
+
+  pte_set_table(pte, V2P(table));
+  dsb(ishst);
+}
+
+/*
+ *  return level 3 pte of @ipa, splitting block mappings on the way
+ *  NULL if unmapped and !create
+ *  for mapping and permission change paths only: lookups use s2_walk()
+ */
+u64 *s2_pagewalk(ipa_t ipa, bool create) {
+  u64 *pgt = vttbr;
+  bool locked = false;
+  u64 *pte = NULL;
+  u64 flags = 0;
+
+  for(int level = s2_root_level; level < 3; level++) {
+    pte = s2_entry(pgt, level, ipa);
+
+    if((*pte & PTE_VALID) && (*pte & PTE_TABLE)) {
+      pgt = P2V(PTE_PA(*pte));
+      continue;
+    }
+
+    if(!locked) {
+      /* retry under lock: someone may be splitting this entry */
+      spin_lock_irqsave(&s2_split_lock, flags);
+      locked = true;
+      level--;
+      continue;
+    }
+
+    if(pte_is_block(*pte, level)) {
+      s2_split_block(pte, level, ipa);
+    } else if(create) {
+      u64 *table = alloc_page();
+      if(!table)
+        panic("nomem");
+
+      pte_set_table(pte, V2P(table));
+    } else {
+      pte = NULL;
+      break;
+    }
+
+    pgt = P2V(PTE_PA(*pte));
+  }
+
+  if(locked)
+    spin_unlock_irqrestore(&s2_split_lock, flags);
+
+  return pte ? &pgt[PIDX(3, ipa)] : NULL;
+}
+
+static u64 *s2_walk_cache_lookup(ipa_t ipa) {
+  struct s2_walk_cache *c;
+  u64 key = ipa >> LEVEL_SHIFT(2);
+  u64 *table = NULL;
+  u64 flags;
+
+  irqsave(flags);
+
+  c = &s2_walk_cache[cpuid()];
+
+  if(c->ent[key % S2_WALK_CACHE_SIZE].key == key)
+    table = c->ent[key % S2_WALK_CACHE_SIZE].table;
+
+  irqrestore(flags);
+
+  return table ? &table[PIDX(3, ipa)] : NULL;
+}
+
+static void s2_walk_cache_fill(ipa_t ipa, u64 *pte) {
+  struct s2_walk_cache *c;
+  u64 key = ipa >> LEVEL_SHIFT(2);
+  u64 flags;
+
+  irqsave(flags);
+
+  c = &s2_walk_cache[cpuid()];
+
+  c->ent[key % S2_WALK_CACHE_SIZE].key = key;
+  c->ent[key % S2_WALK_CACHE_SIZE].table = pte - PIDX(3, ipa);
+
+  irqrestore(flags);
+}
+
+/* leaf entry (page or block) of @ipa without splitting, NULL at an invalid table entry */
+static u64 *__s2_leaf(ipa_t ipa, int *leaf_level) {
+  u64 *pgt = vttbr;
+
+  for(int level = s2_root_level; level <= 3; level++) {
+    u64 *pte = s2_entry(pgt, level, ipa);
+
+    if(level == 3 || pte_is_block(*pte, level)) {
+      *leaf_level = level;
+      return pte;
+    }
+
+    if(!(*pte & PTE_VALID))
+      return NULL;
+
+    pgt = P2V(PTE_PA(*pte));
+  }
+
+  return NULL;
+}
+
+/*
+ *  leaf entry of @ipa and its level, never splits
+ *  a block being split reads invalid for a while: look again under s2_split_lock
+ */
+static u64 *s2_leaf(ipa_t ipa, int *leaf_level) {
+  u64 *pte;
+  u64 flags;
+
+  if((pte = __s2_leaf(ipa, leaf_level)) != NULL)
+    return pte;
+
+  spin_lock_irqsave(&s2_split_lock, flags);
+  pte = __s2_leaf(ipa, leaf_level);
+  spin_unlock_irqrestore(&s2_split_lock, flags);
+
+  return pte;
+}
+
+/*
+ *  leaf entry of @ipa: level 3 pte, or block entry containing @ipa
+ *  lookup only, walk once per fault and test it with s2pte_is_*()
+ *  repeated lookups in the same 2MB skip upper levels
+ *  to change the entry, take it by s2_split_walk()
+ */
+u64 *s2_walk(ipa_t ipa) {
+  u64 *pte;
+  int level;
+
+  if((pte = s2_walk_cache_lookup(ipa)) != NULL)
+    return pte;
+
+  pte = s2_leaf(ipa, &level);
+  if(pte && level == 3)
+    s2_walk_cache_fill(ipa, pte);
+
+  return pte;
+}
+
+/* level 3 pte of @ipa to change it, splitting its block; NULL if unmapped */
+u64 *s2_split_walk(ipa_t ipa) {
+  u64 *pte;
+
+  if((pte = s2_walk_cache_lookup(ipa)) != NULL)
+    return pte;
+
+  pte = s2_pagewalk(ipa, false);
+  if(pte)
+    s2_walk_cache_fill(ipa, pte);
+
+  return pte;
+}
+
 static int parange_map[] = {
   32, 36, 40, 42, 44, 48, 52,
 };
 
 void s2_pte_dump(ipa_t ipa) {
-  u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
+  int level;
+  u64 *pte = s2_leaf(ipa, &level);
   if(!pte) {
     printf("unmapped\n");
     return;
@@ -97,10 +349,66 @@ static inline u64 pageflag_to_s2pte_flags(enum pageflag flags) {
   return f;
 }
 
+static int s2_map_block(ipa_t ipa, physaddr_t pa, u64 flags, int level) {
+  u64 *pgt = vttbr;
+
+  for(int lv = s2_root_level; lv < level; lv++) {
+    u64 *pte = s2_entry(pgt, lv, ipa);
+
+    if((*pte & PTE_VALID) && (*pte & PTE_TABLE)) {
+      pgt = P2V(PTE_PA(*pte));
+    } else if(!(*pte & PTE_VALID)) {
+      pgt = alloc_page();
+      if(!pgt)
+        panic("nomem");
+
+      pte_set_table(pte, V2P(pgt));
+    } else {
+      return -1;
+    }
+  }
+
+  u64 *pte = s2_entry(pgt, level, ipa);
+  if(*pte & PTE_VALID)
+    return -1;
+
+  pte_set_block(pte, pa, flags);
+
+  return 0;
+}
+
+/* use 1GB/2MB block mapping where both ipa and pa are aligned */
 static void __s2_map_pages(ipa_t ipa, physaddr_t pa, u64 size, enum pageflag flags) {
   u64 f = pageflag_to_s2pte_flags(flags);
 
-  mappages(vttbr, ipa, pa, size, f, s2_root_level);
+  assert(PAGE_ALIGNED(ipa) && PAGE_ALIGNED(pa) && PAGE_ALIGNED(size));
+
+  while(size > 0) {
+    int level;
+    u64 bsize = 0;
+
+    for(level = 1; level < 3; level++) {
+      bsize = LEVEL_SIZE(level);
+
+      if(size >= bsize &&
+         ipa % bsize == 0 && pa % bsize == 0 &&
+         s2_map_block(ipa, pa, f, level) == 0)
+        break;
+    }
+
+    if(level == 3) {
+      u64 *pte = s2_pagewalk(ipa, true);
+      if(*pte & PTE_AF)
+        panic("this entry has been used: ipa %p", ipa);
+
+      pte_set_entry(pte, pa, f);
+      bsize = PAGESIZE;
+    }
+
+    ipa += bsize;
+    pa += bsize;
+    size -= bsize;
+  }
 }
 
 void guest_map_page(ipa_t ipa, physaddr_t pa, enum pageflag flags) {
@@ -123,8 +431,8 @@ void s2pageunmap(ipa_t ipa, u64 size) {
     panic("invalid pageunmap");
 
   for(u64 p = 0; p < size; p += PAGESIZE, ipa += PAGESIZE) {
-    u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
-    if(*pte == 0)
+    u64 *pte = s2_pagewalk(ipa, false);
+    if(!pte || *pte == 0)
       panic("already unmapped");
 
     u64 pa = PTE_PA(*pte);
@@ -134,16 +442,32 @@ void s2pageunmap(ipa_t ipa, u64 size) {
   }
 }
 
+/*
+ *  map zeroed guest ram, by 2MB block where ipa is aligned
+ *  pages in a block can be freed one by one after splitting
+ */
 void alloc_guestmem(u64 ipa, u64 size) {
+  u64 end = ipa + size;
+
   if(size % PAGESIZE)
     panic("invalid size");
 
-  for(int i = 0; i < size; i += PAGESIZE) {
+  while(ipa < end) {
+    if(ipa % SZ_2MiB == 0 && end - ipa >= SZ_2MiB) {
+      char *p = alloc_pages(9);   /* 2 MB */
+      if(p) {
+        __s2_map_pages(ipa, V2P(p), SZ_2MiB, PAGE_NORMAL | PAGE_RW);
+        ipa += SZ_2MiB;
+        continue;
+      }
+    }
+
     char *p = alloc_page();
     if(!p)
       panic("p");
 
-    guest_map_page(ipa + i, V2P(p), PAGE_NORMAL | PAGE_RW);
+    guest_map_page(ipa, V2P(p), PAGE_NORMAL | PAGE_RW);
+    ipa += PAGESIZE;
   }
 }
 
@@ -168,62 +492,260 @@ void map_guest_peripherals() {
 
 void s2_map_page_copyset(ipa_t ipa, physaddr_t pa, u64 copyset) {
   u64 flags = S2PTE_NORMAL | S2PTE_COPYSET(copyset);
+  u64 *pte = s2_pagewalk(ipa, true);
+
+  if(*pte & PTE_AF)
+    panic("this entry has been used: ipa %p", ipa);
+
+  pte_set_entry(pte, pa, flags);
+}
+
+u64 *s2_accessible_pte(ipa_t ipa) {
+  assert(PAGE_ALIGNED(ipa));
+
+  u64 *pte = s2_walk(ipa);
 
-  return mappages(vttbr, ipa, pa, PAGESIZE, flags, s2_root_level);
+  return pte && s2pte_is_accessible(pte) ? pte : NULL;
 }
 
 u64 *s2_rwable_pte(ipa_t ipa) {
   assert(PAGE_ALIGNED(ipa));
 
-  u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
-  if(!pte)
-    return NULL;
+  u64 *pte = s2_walk(ipa);
 
-  if((*pte & (PTE_AF | S2PTE_S2AP_MASK)) == (PTE_AF | S2PTE_RW))
-    return pte;
-    
-  return NULL;
+  return pte && s2pte_is_rwable(pte) ? pte : NULL;
 }
 
 u64 *s2_readable_pte(ipa_t ipa) {
   assert(PAGE_ALIGNED(ipa));
 
-  u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
-  if(!pte)
-    return NULL;
+  u64 *pte = s2_walk(ipa);
 
-  if((*pte & PTE_AF) && (*pte & S2PTE_RO))
-    return pte;
-  
-  return NULL;
+  return pte && s2pte_is_readable(pte) ? pte : NULL;
 }
 
 u64 *s2_ro_pte(ipa_t ipa) {
   assert(PAGE_ALIGNED(ipa));
 
-  u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
-  if(!pte)
-    return NULL;
+  u64 *pte = s2_walk(ipa);
 
-  if((*pte & (PTE_AF | S2PTE_S2AP_MASK)) == (PTE_AF | S2PTE_RO))
-    return pte;
-    
-  return NULL;
+  return pte && s2pte_is_ro(pte) ? pte : NULL;
+}
+
+static void s2_free_page(void *page) {
+  free_page(page);
 }
 
 void s2_page_invalidate(ipa_t ipa) {
   assert(PAGE_ALIGNED(ipa));
 
-  u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
+  u64 *pte = s2_split_walk(ipa);
   if(!pte)
     panic("no entry");
 
   u64 pa = PTE_PA(*pte);
 
+  s2_cont_split(pte, ipa);
   s2pte_invalidate(pte);
-  tlb_s2_flush_ipa(ipa);
+  s2_tlb_gather(ipa, PAGESIZE);
+
+  s2_tlb_gather_free(P2V(pa), s2_free_page);
+}
+
+static inline u64 *s2_cont_head(u64 *pte) {
+  return (u64 *)((u64)pte & ~(S2_CONT_PAGES * sizeof(u64) - 1));
+}
+
+/*
+ *  all pages of 64KB run of @ipa are writable, physically contiguous
+ *  and have the same attribute
+ */
+bool s2_cont_check(ipa_t ipa) {
+  u64 pa, attr;
+  int level;
+  u64 *head = s2_leaf(ALIGN_DOWN(ipa, S2_CONT_SIZE), &level);
+
+  if(!head || level != 3)
+    return false;
+
+  pa = PTE_PA(*head);
+  attr = *head & ~PTE_PA(~0ul);
+
+  if(pa % S2_CONT_SIZE != 0)
+    return false;
+
+  for(int i = 0; i < S2_CONT_PAGES; i++) {
+    if(!s2pte_is_rwable(&head[i]) ||
+       PTE_PA(head[i]) != pa + i * PAGESIZE ||
+       (head[i] & ~PTE_PA(~0ul)) != attr)
+      return false;
+  }
+
+  return true;
+}
+
+/*
+ *  set contiguous hint on the run of @ipa
+ *  caller holds page locks of the whole run so that no entry changes
+ */
+bool s2_cont_make(ipa_t ipa) {
+  ipa_t base = ALIGN_DOWN(ipa, S2_CONT_SIZE);
+  u64 *head;
+  u64 flags;
+  int i;
+
+  if(!s2_cont_check(ipa))
+    return false;
+
+  head = s2_split_walk(base);
+
+  if(*head & S2PTE_CONT)
+    return true;
+
+  spin_lock_irqsave(&s2_cont_lock, flags);
+
+  /*
+   *  break-before-make: entries keep PTE_AF, so a fault meanwhile sees
+   *  the page accessible and ipa2pa() waits for the run to be made
+   */
+  for(i = 0; i < S2_CONT_PAGES; i++)
+    head[i] &= ~PTE_VALID;
+
+  tlb_s2_flush_range(base, S2_CONT_SIZE);
+
+  for(i = 0; i < S2_CONT_PAGES; i++)
+    head[i] |= S2PTE_CONT | PTE_VALID;
+
+  dsb(ishst);
+
+  spin_unlock_irqrestore(&s2_cont_lock, flags);
+
+  return true;
+}
+
+/*
+ *  clear contiguous hint of the run containing @pte
+ *  must be called before changing any entry in the run
+ */
+void s2_cont_split(u64 *pte, ipa_t ipa) {
+  u64 *head;
+  u64 flags;
+  int i;
+
+  if(!(*pte & S2PTE_CONT))
+    return;
+
+  spin_lock_irqsave(&s2_cont_lock, flags);
+
+  if(*pte & S2PTE_CONT) {
+    head = s2_cont_head(pte);
+
+    for(i = 0; i < S2_CONT_PAGES; i++)
+      head[i] &= ~PTE_VALID;
+
+    tlb_s2_flush_range(ALIGN_DOWN(ipa, S2_CONT_SIZE), S2_CONT_SIZE);
+
+    for(i = 0; i < S2_CONT_PAGES; i++)
+      head[i] = (head[i] & ~S2PTE_CONT) | PTE_VALID;
+
+    dsb(ishst);
+  }
+
+  spin_unlock_irqrestore(&s2_cont_lock, flags);
+}
+
+void s2_tlb_gather(ipa_t ipa, u64 size) {
+  struct s2_tlb_gather *g;
+  u64 end = ipa + size;
+  u64 flags;
+  int i;
+
+  irqsave(flags);
+
+  g = &s2_gather[cpuid()];
+
+  if(g->all)
+    goto out;
+
+  for(i = 0; i < g->nrange; i++) {
+    /* merge overlapping or adjacent one */
+    if(ipa <= g->range[i].end && g->range[i].start <= end) {
+      g->range[i].start = min(g->range[i].start, ipa);
+      g->range[i].end = max(g->range[i].end, end);
+      goto out;
+    }
+  }
+
+  if(g->nrange == S2_GATHER_NRANGE) {
+    g->all = true;
+    goto out;
+  }
+
+  g->range[g->nrange].start = ipa;
+  g->range[g->nrange].end = end;
+  g->nrange++;
+
+out:
+  irqrestore(flags);
+}
+
+/* free @page by @free after stale tlb entries pointing it are dropped */
+void s2_tlb_gather_free(void *page, void (*free)(void *)) {
+  struct s2_tlb_gather *g;
+  u64 flags;
+
+  irqsave(flags);
+
+  g = &s2_gather[cpuid()];
+
+  if(g->nfree == S2_GATHER_NFREE)
+    s2_tlb_flush_gathered();
+
+  g->freed[g->nfree].page = page;
+  g->freed[g->nfree].free = free;
+  g->nfree++;
 
-  free_page(P2V(pa));
+  irqrestore(flags);
+}
+
+void s2_tlb_flush_gathered() {
+  struct s2_tlb_gather *g;
+  u64 flags;
+  int i;
+
+  irqsave(flags);
+
+  g = &s2_gather[cpuid()];
+
+  if(!g->all) {
+    for(i = 0; i < g->nrange; i++) {
+      if(!tlb_s2_range_ok(g->range[i].end - g->range[i].start)) {
+        g->all = true;
+        break;
+      }
+    }
+  }
+
+  if(g->all) {
+    tlb_s2_flush_all();
+  } else if(g->nrange > 0) {
+    dsb(ishst);
+
+    for(i = 0; i < g->nrange; i++)
+      __tlbi_s2_range(g->range[i].start, g->range[i].end - g->range[i].start);
+
+    tlb_s2_sync();
+  }
+
+  g->all = false;
+  g->nrange = 0;
+
+  for(i = 0; i < g->nfree; i++)
+    g->freed[i].free(g->freed[i].page);
+
+  g->nfree = 0;
+
+  irqrestore(flags);
 }
 
 void guest_icache_invalidate(void *p, u64 size) {
@@ -236,12 +758,13 @@ void guest_icache_invalidate(void *p, u64 size) {
 void s2_page_ro(ipa_t ipa) {
   assert(PAGE_ALIGNED(ipa));
 
-  u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
+  u64 *pte = s2_split_walk(ipa);
   if(!pte)
     panic("no entry");
 
+  s2_cont_split(pte, ipa);
   s2pte_ro(pte);
-  tlb_s2_flush_ipa(ipa);
+  s2_tlb_gather(ipa, PAGESIZE);
 }
 
 void copy_to_guest(ipa_t to_ipa, char *from, u64 len, bool alloc) {
@@ -291,16 +814,35 @@ void copy_from_guest(char *to, ipa_t from_ipa, u64 len) {
   }
 }
 
+/*
+ *  entry of @pte, waiting while its contiguous run is made or split:
+ *  the run is broken (PTE_AF without PTE_VALID) only under s2_cont_lock
+ */
+static u64 s2_pte_stable(u64 *pte) {
+  u64 e = *(volatile u64 *)pte;
+  u64 flags;
+
+  if((e & PTE_AF) && !(e & PTE_VALID)) {
+    spin_lock_irqsave(&s2_cont_lock, flags);
+    e = *pte;
+    spin_unlock_irqrestore(&s2_cont_lock, flags);
+  }
+
+  return e;
+}
+
 physaddr_t ipa2pa(ipa_t ipa) {
-  u64 *pte = pagewalk(vttbr, ipa, s2_root_level, 0);
-  u32 off;
+  int level = 3;
+  u64 *pte = s2_walk_cache_lookup(ipa);
+  u64 e;
 
   if(!pte)
-    return 0;
+    pte = s2_leaf(ipa, &level);
 
-  off = PAGE_OFFSET(ipa);
+  if(!pte || !((e = s2_pte_stable(pte)) & PTE_VALID))
+    return 0;
 
-  return PTE_PA(*pte) + off;
+  return PTE_PA(e) + (ipa & (LEVEL_SIZE(level) - 1));
 }
 
 void *ipa2hva(ipa_t ipa) {
@@ -354,36 +896,53 @@ static int root_level_sl0(int root) {
   return -1;
 }
 
+/*
+ *  guest ipa space: RAM and the highest device window
+ *  (PCIe high MMIO at 512 GB, see map_guest_peripherals()) fit in 40 bit
+ */
+#define S2_IPA_BITS     40
+
 void s2mmu_init() {
   u64 vtcr, mmf_parange = read_sysreg(id_aa64mmfr0_el1) & 0xf;
   int parange = parange_map[mmf_parange];
-  int sl0;
+  int ipa_bits = S2_IPA_BITS;
+  int sl0, order;
 
   printf("id_aa64mmfr0_el1.parange = %d bit\n", parange);
 
-  int min_t0sz = 64 - parange;
+  /* ID_AA64ISAR0_EL1.TLB == 0b0010: TLBIOS and TLBIRANGE */
+  tlbi_range_supported = ((read_sysreg(id_aa64isar0_el1) >> 56) & 0xf) >= 2;
 
   vtcr = VTCR_INNERSH | VTCR_HA | VTCR_HD | VTCR_TG_4K |
          VTCR_ORGN0_WBWA | VTCR_IRGN0_WBWA | VTCR_NSW |
          VTCR_NSA | VTCR_RES1;
 
-  /* PS = 16TB (44 bit) */
-  int t0sz = 64 - 44;
-  if(t0sz < min_t0sz)
-    panic("t0sz %d < min t0sz %pd", t0sz, min_t0sz);
+  if(ipa_bits > parange)
+    panic("ipa %d bit > parange %d bit", ipa_bits, parange);
+
+  /*
+   *  4KB granule: up to 16 concatenated level 1 tables cover 43 bit,
+   *  one level less to walk than starting from level 0
+   */
+  s2_root_level = ipa_bits <= 43 ? 1 : 0;
+  s2_root_entries = 1ul << (ipa_bits - LEVEL_SHIFT(s2_root_level));
+  order = s2_root_entries > 512 ? __builtin_ctzl(s2_root_entries / 512) : 0;
 
-  s2_root_level = 0;
   sl0 = root_level_sl0(s2_root_level);
 
-  vtcr |= VTCR_T0SZ(t0sz) | VTCR_PS_16T | VTCR_SL0(sl0);
+  /* PS: up to 48 bit */
+  vtcr |= VTCR_T0SZ(64 - ipa_bits) | VTCR_PS(min(mmf_parange, 5ul)) | VTCR_SL0(sl0);
 
-  vttbr = alloc_page();
+  /* concatenated root must be aligned to its size: buddy blocks are */
+  vttbr = alloc_pages(order);
   if(!vttbr)
     panic("vttbr failed");
 
   localvm.vttbr = vttbr;
   localvm.vtcr = vtcr;
 
+  printf("stage 2: %d bit ipa, %d level, %d root entries\n",
+         ipa_bits, 4 - s2_root_level, (int)s2_root_entries);
   printf("vtcr_el2: %p\n", vtcr);
   printf("mair_el2: %p\n", read_sysreg(mair_el2));
 }
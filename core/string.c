@@ -0,0 +1,164 @@
+/*
+ *  memcpy/memmove/memset
+ *
+ *  copy 64 byte per loop by u64 words (ldp/stp on aarch64) when dst and src
+ *  have the same alignment, and zero whole cache blocks with dc zva.
+ *  FP/SIMD registers are not used: they hold guest state.
+ *
+ *  no log/printf here: tools/membench builds this file on host.
+ */
+
+#include "types.h"
+#include "lib.h"
+#include "compiler.h"
+
+#define WORD      sizeof(u64)
+#define WMASK     (WORD - 1)
+
+static inline void copy64(u64 *d, const u64 *s) {
+  u64 a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3];
+  u64 a4 = s[4], a5 = s[5], a6 = s[6], a7 = s[7];
+
+  d[0] = a0; d[1] = a1; d[2] = a2; d[3] = a3;
+  d[4] = a4; d[5] = a5; d[6] = a6; d[7] = a7;
+}
+
+static void *memcpy_fwd(void *dst, const void *src, u64 n) {
+  u8 *d = dst;
+  const u8 *s = src;
+
+  if((((u64)d ^ (u64)s) & WMASK) == 0) {
+    while(((u64)d & WMASK) && n) {
+      *d++ = *s++;
+      n--;
+    }
+
+    /* page copy comes here without head/tail */
+    for(; n >= 64; n -= 64, d += 64, s += 64)
+      copy64((u64 *)d, (const u64 *)s);
+
+    for(; n >= WORD; n -= WORD, d += WORD, s += WORD)
+      *(u64 *)d = *(const u64 *)s;
+  }
+
+  while(n--)
+    *d++ = *s++;
+
+  return dst;
+}
+
+static void *memcpy_bwd(void *dst, const void *src, u64 n) {
+  u8 *d = (u8 *)dst + n;
+  const u8 *s = (const u8 *)src + n;
+
+  if((((u64)d ^ (u64)s) & WMASK) == 0) {
+    while(((u64)d & WMASK) && n) {
+      *--d = *--s;
+      n--;
+    }
+
+    for(; n >= 64; n -= 64) {
+      d -= 64;
+      s -= 64;
+      copy64((u64 *)d, (const u64 *)s);
+    }
+
+    for(; n >= WORD; n -= WORD) {
+      d -= WORD;
+      s -= WORD;
+      *(u64 *)d = *(const u64 *)s;
+    }
+  }
+
+  while(n--)
+    *--d = *--s;
+
+  return dst;
+}
+
+void *memcpy(void *dst, const void *src, u64 n) {
+  return memcpy_fwd(dst, src, n);
+}
+
+void *memmove(void *dst, const void *src, u64 n) {
+  /* copy64() loads a whole 64 byte block before storing */
+  if((u8 *)dst <= (const u8 *)src || (u8 *)dst >= (const u8 *)src + n)
+    return memcpy_fwd(dst, src, n);
+  else
+    return memcpy_bwd(dst, src, n);
+}
+
+#ifdef __aarch64__
+
+/* dc zva block size in byte, 0 if prohibited */
+static u64 zva_size(void) {
+  static u64 size = ~0ul;
+  u64 dczid;
+
+  if(likely(size != ~0ul))
+    return size;
+
+  asm volatile("mrs %0, dczid_el0" : "=r"(dczid));
+
+  size = (dczid & (1 << 4)) ? 0 : 4ul << (dczid & 0xf);
+
+  return size;
+}
+
+static u64 memzero_zva(u8 *d, u64 n) {
+  u64 bs = zva_size();
+  u64 done = 0;
+
+  if(bs == 0 || ((u64)d & (bs - 1)))
+    return 0;
+
+  for(; n - done >= bs; done += bs)
+    asm volatile("dc zva, %0" :: "r"(d + done) : "memory");
+
+  return done;
+}
+
+#else
+
+static inline u64 memzero_zva(u8 *d, u64 n) {
+  return 0;
+}
+
+#endif  /* __aarch64__ */
+
+void *memset(void *dst, int c, u64 n) {
+  u8 *d = dst;
+  u64 v = (u8)c;
+
+  v |= v << 8;
+  v |= v << 16;
+  v |= v << 32;
+
+  while(((u64)d & WMASK) && n) {
+    *d++ = c;
+    n--;
+  }
+
+  /* zeroing page */
+  if(c == 0 && n >= 256) {
+    u64 z = memzero_zva(d, n);
+
+    d += z;
+    n -= z;
+  }
+
+  for(; n >= 64; n -= 64, d += 64) {
+    u64 *w = (u64 *)d;
+
+    w[0] = v; w[1] = v; w[2] = v; w[3] = v;
+    w[4] = v; w[5] = v; w[6] = v; w[7] = v;
+  }
+
+  for(; n >= WORD; n -= WORD, d += WORD)
+    *(u64 *)d = v;
+
+  while(n--)
+    *d++ = c;
+
+  return dst;
+}
@@ -19,6 +19,9 @@
 #include "compiler.h"
 #include "panic.h"
 #include "memlayout.h"
+#include "vsm.h"
+#include "vsm-log.h"
+#include "vsm-lat.h"
 
 void vectable(void);
 
@@ -241,11 +244,53 @@ static void vpsci_handler(struct vcpu *vcpu) {
   vcpu->reg.x[0] = vpsci_emulate(vcpu, &argv);
 }
 
+#ifdef VSMTEST
+
+/*
+ *  hvc #1: vsm debug console, only for the benchmark guest
+ *    x0 = 0: dump x1 hottest pages
+ *    x0 = 1: reset statistics
+ *    x0 = 2: dump last x1 trace records of each cpu
+ *    x0 = 3: dump fault latency histograms
+ *    x0 = 4: reset fault latency histograms
+ */
+static int vsm_debug_hvc(struct vcpu *vcpu) {
+  switch(vcpu->reg.x[0]) {
+    case 0:
+      vsm_statdump(vcpu->reg.x[1]);
+      break;
+    case 1:
+      vsm_statreset();
+      break;
+    case 2:
+      vsm_logdump(vcpu->reg.x[1]);
+      break;
+    case 3:
+      vsm_lat_dump();
+      break;
+    case 4:
+      vsm_lat_reset();
+      break;
+    default:
+      vcpu->reg.x[0] = -1;
+      return 0;
+  }
+
+  vcpu->reg.x[0] = 0;
+  return 0;
+}
+
+#endif  /* VSMTEST */
+
 static int hvc_handler(struct vcpu *vcpu, int imm) {
   switch(imm) {
     case 0:
       vpsci_handler(vcpu);
       return 0;
+#ifdef VSMTEST
+    case 1:
+      return vsm_debug_hvc(vcpu);
+#endif
     default:
       return -1;
   }
@@ -349,6 +394,9 @@ void vm_sync_handler() {
       vmm_log("ec %p esr %p elr %p far %p\n", ec, esr, current->reg.elr, far);
       panic("unknown sync");
   }
+
+  /* stage 2 updates of this fault must be visible before the guest resumes */
+  s2_tlb_flush_gathered();
 }
 
 void trapinit() {
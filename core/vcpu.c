@@ -80,6 +80,8 @@ void vcpu_entry() {
 
   // vcpu_dump(current);
 
+  s2_tlb_flush_gathered();
+
   /* vmentry */
   trapret();
 }
@@ -111,8 +113,10 @@ void vcpu_shutdown(struct vcpu *vcpu) {
 void wait_for_current_vcpu_online() {
   vmm_log("cpu%d: current online: %d\n", cpuid(), current->online);
 
-  while(!current->online)
-    wfi();
+  while(!current->online) {
+    if(!page_prezero_idle())
+      wfi();
+  }
 }
 
 void vcpu_preinit() {
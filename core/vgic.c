@@ -13,6 +13,7 @@
 #include "vmmio.h"
 #include "allocpage.h"
 #include "malloc.h"
+#include "objpool.h"
 #include "lib.h"
 #include "localnode.h"
 #include "node.h"
@@ -26,6 +27,9 @@
 
 static struct vgic vgic_dist;
 
+/* vcpu pending queue has 4 entries */
+static DEFINE_OBJPOOL(pendirq_pool, struct gic_pending_irq, NCPU_MAX * 8);
+
 struct sgi_msg_hdr {
   POCV2_MSG_HDR_STRUCT;
   int target;
@@ -87,7 +91,7 @@ void vgic_inject_pending_irqs() {
 
     head = (head + 1) % 4;
 
-    free(pendirq);
+    objpool_free(&pendirq_pool, pendirq);
   }
 
   vcpu->pending.head = head;
@@ -113,7 +117,7 @@ static int vgic_inject_virq_local(struct vcpu *target, struct gic_pending_irq *p
     if(localnode.irqchip->inject_guest_irq(pendirq) < 0)
       ;   /* do nothing */
 
-    free(pendirq);
+    objpool_free(&pendirq_pool, pendirq);
   } else {
     u64 flags = 0;
 
@@ -167,7 +171,7 @@ int vgic_inject_virq(struct vcpu *target, u32 virqno) {
   if(!irq || !irq->enabled)
     return -1;
 
-  struct gic_pending_irq *pendirq = malloc(sizeof(*pendirq));
+  struct gic_pending_irq *pendirq = objpool_alloc(&pendirq_pool);
 
   pendirq->virq = virqno;
   pendirq->group = irq->igroup;       /* irq->igroup */
@@ -187,7 +191,7 @@ int vgic_inject_virq(struct vcpu *target, u32 virqno) {
       panic("target?");
   } else {
     vmm_warn("virq%d not exist\n", virqno);
-    free(pendirq);
+    objpool_free(&pendirq_pool, pendirq);
     return -1;
   }
 
@@ -197,7 +201,7 @@ int vgic_inject_virq(struct vcpu *target, u32 virqno) {
     rc = vgic_inject_virq_remote(irq, pendirq);
 
   if(rc < 0)
-    free(pendirq);
+    objpool_free(&pendirq_pool, pendirq);
 
   return rc;
 }
@@ -0,0 +1,121 @@
+/*
+ *  latency histograms of vsm fault paths
+ *
+ *  per-cpu log2 histogram in cycles: bucket i counts [2^i, 2^(i+1))
+ */
+
+#include "vsm-lat.h"
+#include "aarch64.h"
+#include "param.h"
+#include "printf.h"
+#include "lib.h"
+#include "compiler.h"
+
+#define LAT_NBUCKET   40
+
+struct vsm_lat_hist {
+  u32 bucket[NR_VSM_LAT][LAT_NBUCKET];
+  u64 sum[NR_VSM_LAT];
+  u64 max[NR_VSM_LAT];
+} __aligned(64);
+
+static struct vsm_lat_hist vsm_lat[NCPU_MAX];
+
+static const char *latname[NR_VSM_LAT] = {
+  [LAT_READ_LOCAL]    "read local",
+  [LAT_READ_2HOP]     "read 2hop",
+  [LAT_READ_3HOP]     "read 3hop",
+  [LAT_WRITE_LOCAL]   "write local",
+  [LAT_WRITE_2HOP]    "write 2hop",
+  [LAT_WRITE_3HOP]    "write 3hop",
+  [LAT_INV_FANOUT]    "inv fanout",
+  [LAT_READ_SERVER]   "read server",
+  [LAT_WRITE_SERVER]  "write server",
+  [LAT_INV_SERVER]    "inv server",
+  [LAT_LEASE_SERVER]  "lease server",
+  [LAT_MANAGER_SERVER] "manager server",
+};
+
+void vsm_lat_record(enum vsm_lat kind, u64 cycles) {
+  struct vsm_lat_hist *h;
+  int b = cycles ? 63 - __builtin_clzl(cycles) : 0;
+  u64 flags;
+
+  if(b >= LAT_NBUCKET)
+    b = LAT_NBUCKET - 1;
+
+  irqsave(flags);
+
+  h = &vsm_lat[cpuid()];
+
+  h->bucket[kind][b]++;
+  h->sum[kind] += cycles;
+  if(cycles > h->max[kind])
+    h->max[kind] = cycles;
+
+  irqrestore(flags);
+}
+
+static inline u64 cycles_to_ns(u64 cycles, u64 freq) {
+  return cycles * 1000 / (freq / 1000000);
+}
+
+/* upper bound of the bucket containing @per mille of @count */
+static u64 lat_percentile(u64 *bucket, u64 count, int per) {
+  u64 n = 0, rank = (count * per + 999) / 1000;
+
+  for(int b = 0; b < LAT_NBUCKET; b++) {
+    n += bucket[b];
+    if(n >= rank)
+      return 1ul << (b + 1);
+  }
+
+  return 1ul << LAT_NBUCKET;
+}
+
+/* merged over all cpus, in ns */
+void vsm_lat_dump() {
+  u64 freq = read_sysreg(cntfrq_el0);
+  u64 bucket[LAT_NBUCKET];
+  u64 count, sum, max;
+  int kind, cpu, b;
+
+  printf("vsm latency (ns) count mean p50 p99 p999 max\n");
+
+  for(kind = 0; kind < NR_VSM_LAT; kind++) {
+    count = sum = max = 0;
+
+    for(b = 0; b < LAT_NBUCKET; b++) {
+      bucket[b] = 0;
+
+      for(cpu = 0; cpu < NCPU_MAX; cpu++)
+        bucket[b] += vsm_lat[cpu].bucket[kind][b];
+
+      count += bucket[b];
+    }
+
+    if(count == 0)
+      continue;
+
+    for(cpu = 0; cpu < NCPU_MAX; cpu++) {
+      sum += vsm_lat[cpu].sum[kind];
+      max = max(max, vsm_lat[cpu].max[kind]);
+    }
+
+    printf("%s: %d %d <%d <%d <%d %d\n", latname[kind], (int)count,
+           (int)cycles_to_ns(sum / count, freq),
+           (int)cycles_to_ns(lat_percentile(bucket, count, 500), freq),
+           (int)cycles_to_ns(lat_percentile(bucket, count, 990), freq),
+           (int)cycles_to_ns(lat_percentile(bucket, count, 999), freq),
+           (int)cycles_to_ns(max, freq));
+
+    for(b = 0; b < LAT_NBUCKET; b++) {
+      if(bucket[b])
+        printf("  <%d: %d\n", (int)cycles_to_ns(1ul << (b + 1), freq), (int)bucket[b]);
+    }
+  }
+}
+
+void vsm_lat_reset() {
+  memset(vsm_lat, 0, sizeof(vsm_lat));
+}
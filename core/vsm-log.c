@@ -1,90 +1,108 @@
 /*
- *  logger for vsm
+ *  binary trace for vsm
+ *
+ *  each cpu writes fixed-size records to its own ring without lock,
+ *  so tracing can be kept enabled.  vsm_logdump() merges the rings of
+ *  all cpus in timestamp order.
  */
 
 #include "vsm-log.h"
-#include "spinlock.h"
-#include "assert.h"
-
-static struct vsmlog vsmlog[4096];
-static int ring_idx = 0;
-static bool loop = false;
-static spinlock_t vloglock = SPINLOCK_INIT;
-
-static const char *tyfmt[] = {
-  [READ_SENDER]     "[read-req]",
-  [READ_RECEIVER]   "[read-recv]",
-  [WRITE_SENDER]    "[write-req]",
-  [WRITE_RECEIVER]  "[write-recv]",
-  [INV_SENDER]      "[inv-req]",
-  [INV_RECEIVER]    "[inv-recv]",
-  [VSM_INFO]        "[info]",
+#include "aarch64.h"
+#include "arch-timer.h"
+#include "param.h"
+#include "printf.h"
+#include "compiler.h"
+
+/* records per cpu, power of 2 */
+#define VLOG_NENT   1024
+
+struct vsmlog_ring {
+  u64 head;       /* records written so far */
+  struct vsmlog ent[VLOG_NENT];
+} __aligned(64);
+
+static struct vsmlog_ring vsmlog[NCPU_MAX];
+
+static const char *tyfmt[NR_VSM_TRACE] = {
+  [READ_SENDER]     "read-req",
+  [READ_RECEIVER]   "read-recv",
+  [WRITE_SENDER]    "write-req",
+  [WRITE_RECEIVER]  "write-recv",
+  [INV_SENDER]      "inv-req",
+  [INV_RECEIVER]    "inv-recv",
+  [READ_DONE]       "read-done",
+  [WRITE_DONE]      "write-done",
+  [VSM_INFO]        "info",
 };
 
-void vsm_logdump(int n) {
-  int start;
+void vsm_logging(int type, int src, int dst, u64 ipa, u32 connid, u32 latency) {
+  struct vsmlog_ring *r;
   struct vsmlog *vl;
+  u64 flags;
 
-  assert(n < 4096);
-
-  if(ring_idx < n) {
-    if(loop) {
-      start = ring_idx + 4096 - n;
-    } else {
-      start = 0;
-      n = ring_idx;
-    }
-  } else {
-    start = ring_idx - n;
-  }
+  /* only this cpu writes its ring: masking irq is enough */
+  irqsave(flags);
 
-  while(n-- > 0) {
-    vl = &vsmlog[start];
+  r = &vsmlog[cpuid()];
+  vl = &r->ent[r->head % VLOG_NENT];
 
-    if(!vl->msg)
-      vl->msg = "";
+  vl->time = now_cycles();
+  vl->ipa = ipa;
+  vl->connid = connid;
+  vl->latency = latency;
+  vl->type = type;
+  vl->cpu = cpuid();
+  vl->src = src;
+  vl->dst = dst;
 
-    if(vl->type == VSM_INFO || vl->from_node < 0) {
-      printf("%s:cpu%d @%p %s %p\n", tyfmt[vl->type], vl->cpu, vl->ipa, vl->msg, vl->daif);
-    } else {
-      printf("%s:cpu%d from: Node %d to: Node %d @%p %s %p\n",
-             tyfmt[vl->type], vl->cpu, vl->from_node, vl->to_node, vl->ipa, vl->msg, vl->daif);
-    }
+  r->head++;
 
-    start = (start + 1) % 4096;
-  }
+  irqrestore(flags);
 }
 
-void vsm_logging(int type, int from_node, int to_node, u64 ipa, const char *msg) {
-  u64 flags;
+/*
+ *  dump last @n (up to VLOG_NENT) records of each cpu merged by timestamp
+ *  records being overwritten meanwhile may be printed torn
+ */
+void vsm_logdump(int n) {
+  u64 cur[NCPU_MAX], end[NCPU_MAX];
+  struct vsmlog *vl;
+  int cpu, next;
 
-  spin_lock_irqsave(&vloglock, flags);
+  /* may come from guest */
+  if(n <= 0)
+    return;
+  if(n > VLOG_NENT)
+    n = VLOG_NENT;
 
-  struct vsmlog *vl = &vsmlog[ring_idx];
+  for(cpu = 0; cpu < NCPU_MAX; cpu++) {
+    end[cpu] = vsmlog[cpu].head;
+    cur[cpu] = end[cpu] > (u64)n ? end[cpu] - n : 0;
+  }
 
-  ring_idx = (ring_idx + 1) % 4096;
-  if(ring_idx == 0)
-    loop = true;
+  printf("vsm trace: time cpu event src -> dst ipa connid latency\n");
 
-  vl->type = type;
-  vl->from_node = from_node;
-  vl->cpu = cpuid();
-  vl->to_node = to_node;
-  vl->ipa = ipa;
-  vl->msg = msg;
-  vl->daif = flags;
+  for(;;) {
+    next = -1;
 
-  spin_unlock_irqrestore(&vloglock, flags);
-}
+    for(cpu = 0; cpu < NCPU_MAX; cpu++) {
+      if(cur[cpu] == end[cpu])
+        continue;
+
+      if(next < 0 ||
+         vsmlog[cpu].ent[cur[cpu] % VLOG_NENT].time <
+         vsmlog[next].ent[cur[next] % VLOG_NENT].time)
+        next = cpu;
+    }
+
+    if(next < 0)
+      break;
 
-void vsm_log_out(int type, int from_node, int to_node, u64 ipa, const char *msg) {
-  if(!msg)
-    msg = "";
+    vl = &vsmlog[next].ent[cur[next] % VLOG_NENT];
+    cur[next]++;
 
-  if(type == VSM_INFO || from_node < 0) {
-    printf("%s:cpu%d @%p %s\n", tyfmt[type], cpuid(), ipa, msg);
-  } else {
-    printf("%s:cpu%d from: Node %d to: Node %d "
-           "@%p %s\n", tyfmt[type], cpuid(), from_node, to_node, ipa, msg);
+    printf("%p cpu%d %s %d -> %d %p %x %u\n",
+           vl->time, vl->cpu, vl->type < NR_VSM_TRACE ? tyfmt[vl->type] : "?",
+           vl->src, vl->dst, vl->ipa, (u64)vl->connid, vl->latency);
   }
 }
@@ -22,15 +22,16 @@
 #include "assert.h"
 #include "compiler.h"
 #include "vsm-log.h"
+#include "vsm-lat.h"
 #include "memlayout.h"
 #include "cache.h"
+#include "objpool.h"
 
 #define ipa_to_pfn(ipa)       (((ipa) - 0x40000000) >> PAGESHIFT)
 #define ipa_to_desc(ipa)      (&ptable[ipa_to_pfn(ipa)])
 
 #define page_desc_addr(page)  ((((page) - ptable) << PAGESHIFT) + 0x40000000)
 
-static struct manager_page manager[NR_MANAGER_PAGES];
 static struct page_desc ptable[GVM_MEMORY / PAGESIZE];
 
 static u64 w_copyset = 0;
@@ -49,10 +50,143 @@ enum fetch_type {
   WRITE_FETCH               = 1,
 };
 
+/* fetch flags */
+#define FETCH_F_PREFETCH    (1 << 0)    /* speculative read; owner may decline */
+#define FETCH_F_LEASE       (1 << 1)    /* requester can hold a read lease */
+#define FETCH_F_FWD         (1 << 2)    /* forwarded by manager to owner */
+#define FETCH_F_BLOCK       (1 << 3)    /* rest of block after read fault */
+
+/*
+ *  sequential-access prefetcher (per vCPU)
+ *  two consecutive remote read faults on neighbouring pages make a stream;
+ *  the window grows while the stream continues past prefetched pages and
+ *  shrinks when it breaks.
+ */
+#define VSM_PREFETCH_MIN    1
+#define VSM_PREFETCH_MAX    8
+
+struct vsm_prefetcher {
+  u64 last_ipa;       /* last remote read fault */
+  u64 next_ipa;       /* fault address if stream continues */
+  int stride;         /* +1 or -1 page, 0: no stream */
+  int window;
+  int issued;         /* prefetched pages in current window */
+  u64 hit;
+  u64 waste;
+};
+
+/* vCPU n runs on pCPU n */
+static struct vsm_prefetcher prefetcher[NCPU_MAX];
+
+/*
+ *  block read fetch region: a read fault fetches the rest of its block
+ *  (64KB or 2MB) by batched fetch.  this is not a coherence granule:
+ *  owner, copyset and manager are kept per page, and writes and
+ *  invalidations move single pages.  a block falls back to 4KB fetch
+ *  after VSM_FALSE_SHARING of its pages moved away
+ */
+struct vsm_region {
+  u64 start;
+  u64 size;
+  int shift;        /* log2 of block size */
+  u8 *conflict;     /* per block: num of invalidations or VSM_BLOCK_DEMOTED */
+};
+
+#define NR_VSM_REGION       4
+#define VSM_FALSE_SHARING   4
+#define VSM_BLOCK_DEMOTED   0xff
+
+static struct vsm_region vsm_region[NR_VSM_REGION];
+static int nr_vsm_region;
+
+#ifndef VSM_BLOCK_FETCH_KERNEL
+#define VSM_BLOCK_FETCH_KERNEL  1     /* 0: guest kernel image is fetched per page */
+#endif
+
+/* regions fetched by block, must be in guest ram */
+static const struct {
+  u64 start;
+  u64 size;
+  int shift;
+} vsm_block_fetch_config[] = {
+#if VSM_BLOCK_FETCH_KERNEL
+  { 0x40000000, 0x1000000, 21 },    /* guest kernel image: text is read by all nodes */
+#endif
+  { 0, 0, 0 },
+};
+
+/* server procs queued on pages */
+static DEFINE_OBJPOOL(vsm_proc_pool, struct vsm_server_proc, NCPU_MAX * 64);
+
+/*
+ *  guest pages referenced by in-flight fetch replies (zero copy tx);
+ *  freeing a held page is deferred until its last tx completes, and a
+ *  writer moves the mapping to a copy instead of waiting for it
+ */
+#define VSM_TXHOLD_MAX      64
+
+struct vsm_txhold {
+  void *page;
+  int ref;
+  bool dead;
+};
+
+static struct vsm_txhold txhold[VSM_TXHOLD_MAX];
+static spinlock_t txhold_lock = SPINLOCK_INIT;
+
+/*
+ *  read leases of read-mostly pages
+ *  owner of a page read only for lease_idle grants a time-bounded lease
+ *  instead of adding the requester to copyset.  a leased copy is never
+ *  invalidated: its holder drops it at the tail of irq before the lease
+ *  runs out (vsm_lease_expire()), and a writer waits until all leases
+ *  granted on the page ran out.  lapsed leases are fetched again in batch.
+ *  all nodes must have the same lease configuration and timer frequency.
+ *
+ *  lease clock: now_cycles() >> VSM_LEASE_SHIFT, compared with wraparound
+ */
+#define VSM_LEASE_IDLE_US   0         /* e.g. 100000 */
+#define VSM_LEASE_US        0         /* e.g. 10000; 0: no lease */
+
+#define VSM_LEASE_SHIFT     10
+#define VSM_LEASE_MARGIN    4         /* holder drops copy at 3/4 of lease */
+#define VSM_LEASE_LAPSED    1         /* holder: lease ran out */
+#define VSM_LEASE_MAX       4096
+
+struct vsm_lease {
+  u64 ipa;
+  u32 expire;
+};
+
+static u32 lease_idle;
+static u32 lease_len;               /* 0: no lease */
+
+/* leases held by this node in expiry order */
+static struct vsm_lease lease_ring[VSM_LEASE_MAX];
+static u32 lease_head, lease_tail;
+static u32 nlease;                  /* held or reserved by requests in flight */
+static spinlock_t lease_lock = SPINLOCK_INIT;
+
+static u64 lease_granted, lease_expired;
+
+/*
+ *  page directory
+ *  manager of a page is its home node at first, and moves to the owner
+ *  after manager forwarded VSM_MIGRATE_FWD requests in a row to it.
+ *  the others keep probable manager of each page: updated by hint in fetch
+ *  reply, and old manager points to its successor, so a request reaches
+ *  manager along a chain.  home node is not told where manager went.
+ */
+#define VSM_MIGRATE_FWD     4
+
+static u64 manager_migrated;
+
 enum {
   READ_SERVER           = 0,
   WRITE_SERVER          = 1,
   INV_SERVER            = 2,
+  LEASE_SERVER          = 3,
+  MANAGER_SERVER        = 4,
 };
 
 struct vsm_rw_data {
@@ -63,12 +197,35 @@ struct vsm_rw_data {
 
 static void *__vsm_write_fetch_page(struct page_desc *page, struct vsm_rw_data *d);
 static void *__vsm_read_fetch_page(struct page_desc *page, struct vsm_rw_data *d);
-static void send_fetch_req(u8 req, u8 dst, u64 ipa, enum fetch_type type,
-                           bool waitreply, int req_cpu);
+static int send_fetch_req(u8 req, u8 dst, u64 ipa, enum fetch_type type,
+                          int flags, bool waitreply, u32 connid);
+static int send_fetch_batch_req(u8 dst, u64 ipa, u32 bitmap, int flags);
+static void vsm_free_page(void *page);
+static int vsm_page_tx_detach(u64 ipa, u64 *pte);
+static void vsm_block_conflict(u64 ipa);
+
+static inline void stat_inc(u16 *c) {
+  if(*c != 0xffff)
+    (*c)++;
+}
+
+/* manager side: @req_nodeid asks for @p (and its ownership if @wr) */
+static inline void vsm_stat_manager(struct manager_page *p, int req_nodeid, bool wr) {
+  p->last_req = req_nodeid;
+  if(wr)
+    stat_inc(&p->nowner);
+}
+
+/* owner has rw page, or ro page with copyset */
+static inline bool vsm_pte_owner(u64 *pte) {
+  return s2pte_is_rwable(pte) || (s2pte_is_ro(pte) && s2pte_copyset(pte) != 0);
+}
 
 static void vsm_read_server_process(struct vsm_server_proc *proc);
 static void vsm_write_server_process(struct vsm_server_proc *proc);
 static void vsm_invalidate_server_process(struct vsm_server_proc *proc);
+static void vsm_lease_server_process(struct vsm_server_proc *proc);
+static void vsm_manager_server_process(struct vsm_server_proc *proc);
 
 /*
  *  memory fetch message
@@ -86,6 +243,7 @@ struct fetch_req_hdr {
   POCV2_MSG_HDR_STRUCT;
   u64 ipa;
   u8 req_nodeid;
+  u8 flags;
   enum fetch_type type;
 };
 
@@ -94,12 +252,47 @@ struct fetch_reply_hdr {
   u64 ipa;
   u64 copyset;
   bool wnr;     // 0 read 1 write fetch
+  u8 flags;     // flags of request
+  u32 lease;    // read: lease granted, write: lease left on page (lease clock)
+  u8 manager;   // manager of page as far as replier knows, or VSM_NO_NODE
 };
 
 struct fetch_reply_body {
   u8 page[PAGESIZE];
 };
 
+/*
+ *  batched fetch message
+ *  request: Node n1 ---> Node n2
+ *    send
+ *      - base ipa and bitmap of requested pages (up to 32 pages from base)
+ *
+ *  reply:   Node n1 <--- owner of each page
+ *    one MSG_FETCH_REPLY per requested page on the same connection
+ */
+
+#define FETCH_BATCH_MAX     32
+
+struct fetch_batch_req_hdr {
+  POCV2_MSG_HDR_STRUCT;
+  u64 ipa;
+  u32 bitmap;
+  u8 req_nodeid;
+  u8 flags;
+  enum fetch_type type;
+};
+
+/* requester side state of batched fetch */
+struct vsm_fetch_batch {
+  u64 ipa;
+  u32 bitmap;
+  u32 pending;        /* pages whose reply has not arrived */
+  int flags;
+};
+
+/* one per async pending slot at most */
+static DEFINE_OBJPOOL(vsm_batch_pool, struct vsm_fetch_batch, NCPU_MAX * NR_MSG_PENDING);
+
 struct invalidate_hdr {
   POCV2_MSG_HDR_STRUCT;
   u64 ipa;
@@ -107,26 +300,178 @@ struct invalidate_hdr {
   u8 from_nodeid;
 };
 
-static inline void send_read_fetch_req(int from_node, int to_node,
-                                       ipa_t page_ipa) {
-  send_fetch_req(from_node, to_node, page_ipa, READ_FETCH, true, cpuid());
+/*
+ *  manager migration: old manager ---> owner of page
+ *    send
+ *      - intermediate physical address(ipa)
+ */
+struct manager_hdr {
+  POCV2_MSG_HDR_STRUCT;
+  u64 ipa;
+};
+
+static inline int send_read_fetch_req(int from_node, int to_node,
+                                      ipa_t page_ipa, int flags) {
+  return send_fetch_req(from_node, to_node, page_ipa, READ_FETCH, flags, true, 0);
 }
 
-static inline void send_write_fetch_req(int from_node, int to_node,
-                                        ipa_t page_ipa) {
-  send_fetch_req(from_node, to_node, page_ipa, WRITE_FETCH, true, cpuid());
+static inline int send_write_fetch_req(int from_node, int to_node,
+                                       ipa_t page_ipa, int flags) {
+  return send_fetch_req(from_node, to_node, page_ipa, WRITE_FETCH, flags, true, 0);
 }
 
 static inline void forward_read_fetch_req(int from_node, int to_node,
-                                          ipa_t page_ipa, int req_cpu) {
-  send_fetch_req(from_node, to_node, page_ipa, READ_FETCH, false, req_cpu);
+                                          ipa_t page_ipa, int flags, u32 connid) {
+  send_fetch_req(from_node, to_node, page_ipa, READ_FETCH, flags, false, connid);
 }
 
 static inline void forward_write_fetch_req(int from_node, int to_node,
-                                           ipa_t page_ipa, int req_cpu) {
-  send_fetch_req(from_node, to_node, page_ipa, WRITE_FETCH, false, req_cpu);
+                                           ipa_t page_ipa, int flags, u32 connid) {
+  send_fetch_req(from_node, to_node, page_ipa, WRITE_FETCH, flags, false, connid);
+}
+
+static inline u32 lease_clock() {
+  return now_cycles() >> VSM_LEASE_SHIFT;
+}
+
+static inline u32 lease_ticks(u32 us) {
+  return usec_to_cycles(us) >> VSM_LEASE_SHIFT;
+}
+
+/* @a is later than @b */
+static inline bool lease_after(u32 a, u32 b) {
+  return (i32)(a - b) > 0;
+}
+
+/* 0 and VSM_LEASE_LAPSED are not a time */
+static inline u32 lease_stamp(u32 t) {
+  return t > VSM_LEASE_LAPSED ? t : VSM_LEASE_LAPSED + 1;
+}
+
+/* room for a lease granted to a request about to be sent */
+static bool vsm_lease_reserve() {
+  bool ok;
+  u64 flags;
+
+  if(!lease_len)
+    return false;
+
+  spin_lock_irqsave(&lease_lock, flags);
+
+  if((ok = nlease < VSM_LEASE_MAX))
+    nlease++;
+
+  spin_unlock_irqrestore(&lease_lock, flags);
+
+  return ok;
+}
+
+static void vsm_lease_cancel(int n) {
+  u64 flags;
+
+  spin_lock_irqsave(&lease_lock, flags);
+  nlease -= n;
+  spin_unlock_irqrestore(&lease_lock, flags);
+}
+
+/*
+ *  holder: hyp timer of this cpu fires when head of lease ring runs out,
+ *  so a vcpu spinning in guest without irq never outlives its lease
+ */
+static void vsm_lease_arm() {
+  u64 base = now_cycles() >> VSM_LEASE_SHIFT;
+  u32 head = lease_head, tail = lease_tail;
+  i32 left;
+
+  if(head == tail) {
+    hyp_timer_disarm(HYP_TIMER_LEASE);
+    return;
+  }
+
+  /* stable while head is the same: hyp_timer_arm() skips rewriting it */
+  left = lease_ring[head % VSM_LEASE_MAX].expire - (u32)base;
+  hyp_timer_arm(HYP_TIMER_LEASE, (base + left) << VSM_LEASE_SHIFT);
+}
+
+/* holder: got lease of @ticks on @ipa, reserved before the request */
+static void vsm_lease_hold(u64 ipa, u32 ticks) {
+  /* counted from reply: margin covers the wire */
+  u32 expire = lease_stamp(lease_clock() + ticks - ticks / VSM_LEASE_MARGIN);
+  u64 flags;
+
+  ipa_to_desc(ipa)->lease = expire;
+
+  spin_lock_irqsave(&lease_lock, flags);
+
+  lease_ring[lease_tail % VSM_LEASE_MAX].ipa = ipa;
+  lease_ring[lease_tail % VSM_LEASE_MAX].expire = expire;
+  lease_tail++;
+
+  vsm_lease_arm();
+
+  spin_unlock_irqrestore(&lease_lock, flags);
+}
+
+/* requester: lease part of fetch reply */
+static void vsm_lease_reply(struct fetch_reply_hdr *a) {
+  struct page_desc *page = ipa_to_desc(a->ipa);
+
+  if(a->wnr) {
+    /* leases of previous owner still run */
+    page->lease = a->lease ? lease_stamp(lease_clock() + a->lease) : 0;
+  } else if(a->flags & FETCH_F_LEASE) {
+    if(a->lease)
+      vsm_lease_hold(a->ipa, a->lease);
+    else
+      vsm_lease_cancel(1);
+  }
+}
+
+/* owner: lease instead of copyset if @page stayed read only long enough */
+static u32 vsm_lease_grant(struct page_desc *page, int flags) {
+  u32 now = lease_clock(), until;
+
+  if(!lease_len || !(flags & FETCH_F_LEASE) || page->lwait ||
+     now - page->rosince < lease_idle)
+    return 0;
+
+  until = lease_stamp(now + lease_len);
+  if(!page->lease || lease_after(until, page->lease))
+    page->lease = until;
+
+  lease_granted++;
+
+  return lease_len;
+}
+
+/* owner: hand over leases of @page to next owner */
+static u32 vsm_lease_left(struct page_desc *page) {
+  u32 now = lease_clock(), left = 0;
+
+  /* +1: lease clocks of nodes are not in phase */
+  if(page->lease && lease_after(page->lease, now))
+    left = page->lease - now + 1;
+
+  page->lease = 0;
+
+  return left;
+}
+
+/* owner: leased copies are not invalidated, a writer waits for them to run out */
+static bool vsm_lease_running(struct page_desc *page) {
+  if(page->lease && lease_after(page->lease, lease_clock()))
+    return true;
+
+  page->lease = 0;
+  return false;
+}
+
+static inline bool page_locked(struct page_desc *page) {
+  return !!page->lock;
 }
 
+#ifdef __aarch64__
+
 /*
  *  success: return 0
  *  else:    return 1
@@ -148,10 +493,6 @@ static inline int page_trylock(struct page_desc *page) {
   return r;
 }
 
-static inline bool page_locked(struct page_desc *page) {
-  return !!page->lock;
-}
-
 static inline void page_spinlock(struct page_desc *page) {
   u8 *lock = &page->lock;
   u8 r, l = cpuid() + 1;
@@ -225,6 +566,57 @@ static inline void vwq_unlock(struct page_desc *page) {
   asm volatile("stlrb wzr, [%0]" :: "r"(&page->wqlock) : "memory");
 }
 
+#else   /* !__aarch64__ */
+
+/* same protocol with compiler atomics: tools/vsmsim builds this file on host */
+
+static inline int page_trylock(struct page_desc *page) {
+  u8 unlocked = 0;
+
+  return !__atomic_compare_exchange_n(&page->lock, &unlocked, (u8)(cpuid() + 1), false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void page_spinlock(struct page_desc *page) {
+  while(page_trylock(page))
+    wfe();
+}
+
+static inline void page_unlock(struct page_desc *page) {
+  __atomic_store_n(&page->ll, 0, __ATOMIC_RELEASE);
+}
+
+static inline void page_vwq_lock(struct page_desc *page) {
+  u16 unlocked, l = 0x0100 | ((cpuid() + 1) & 0xff);
+
+  for(;;) {
+    unlocked = 0;
+    if(__atomic_compare_exchange_n(&page->ll, &unlocked, l, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return;
+    wfe();
+  }
+}
+
+static inline bool vwq_lock(struct page_desc *page) {
+  u16 ll;
+
+  for(;;) {
+    ll = __atomic_load_n(&page->ll, __ATOMIC_RELAXED);
+    if(!(ll & 0xff00) &&
+       __atomic_compare_exchange_n(&page->ll, &ll, 0x0101, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return !(ll & 0x00ff);
+    wfe();
+  }
+}
+
+static inline void vwq_unlock(struct page_desc *page) {
+  __atomic_store_n(&page->wqlock, 0, __ATOMIC_RELEASE);
+}
+
+#endif  /* __aarch64__ */
+
 static inline bool vwq_locked(struct page_desc *page) {
   return !!page->wqlock;
 }
@@ -234,22 +626,25 @@ static inline void vwqinit(struct vsm_waitqueue *wq) {
 }
 
 static struct vsm_server_proc *new_vsm_server_proc(u64 page_ipa, int req_nodeid,
-                                                   enum fetch_type type, int req_cpu) {
-  struct vsm_server_proc *p = malloc(sizeof(*p));
+                                                   enum fetch_type type, int flags,
+                                                   u32 req_connid) {
+  struct vsm_server_proc *p = objpool_alloc(&vsm_proc_pool);
 
   p->type = type;
+  p->flags = flags;
   p->page_ipa = page_ipa;
   p->req_nodeid = req_nodeid;
   p->do_process = type == READ_FETCH ? vsm_read_server_process
                                      : vsm_write_server_process;
-  p->req_cpu = req_cpu;
+  p->req_connid = req_connid;
+  p->manager = VSM_NO_NODE;
 
   return p;
 }
 
 static struct vsm_server_proc *new_vsm_inv_server_proc(u64 page_ipa, int from_nodeid,
                                                        u64 copyset) {
-  struct vsm_server_proc *p = malloc(sizeof(*p));
+  struct vsm_server_proc *p = objpool_alloc(&vsm_proc_pool);
 
   p->type = INV_SERVER;
   p->page_ipa = page_ipa;
@@ -260,6 +655,45 @@ static struct vsm_server_proc *new_vsm_inv_server_proc(u64 page_ipa, int from_no
   return p;
 }
 
+static struct vsm_server_proc *new_vsm_lease_server_proc(u64 page_ipa, u32 lease) {
+  struct vsm_server_proc *p = objpool_alloc(&vsm_proc_pool);
+
+  p->type = LEASE_SERVER;
+  p->page_ipa = page_ipa;
+  p->lease = lease;
+  p->do_process = vsm_lease_server_process;
+
+  return p;
+}
+
+static struct vsm_server_proc *new_vsm_manager_server_proc(u64 page_ipa, int from_nodeid) {
+  struct vsm_server_proc *p = objpool_alloc(&vsm_proc_pool);
+
+  p->type = MANAGER_SERVER;
+  p->page_ipa = page_ipa;
+  p->req_nodeid = from_nodeid;
+  p->do_process = vsm_manager_server_process;
+
+  return p;
+}
+
+static void vsm_do_process(struct vsm_server_proc *p) {
+  enum vsm_lat kind;
+  u64 t0 = now_cycles();
+
+  switch(p->type) {
+    case READ_FETCH:    kind = LAT_READ_SERVER; break;
+    case WRITE_FETCH:   kind = LAT_WRITE_SERVER; break;
+    case LEASE_SERVER:  kind = LAT_LEASE_SERVER; break;
+    case MANAGER_SERVER: kind = LAT_MANAGER_SERVER; break;
+    default:            kind = LAT_INV_SERVER; break;
+  }
+
+  p->do_process(p);
+
+  vsm_lat_record(kind, now_cycles() - t0);
+}
+
 /*
  *  return value:
  *    0: nothing to do
@@ -312,10 +746,10 @@ reprocess:
 
   for(p = head; p; p = p_next) {
     vmm_log("processing queue..... %p %p\n", p, page_desc_addr(page));
-    p->do_process(p);
+    vsm_do_process(p);
 
     p_next = p->next;
-    free(p);
+    objpool_free(&vsm_proc_pool, p);
   }
 
   vmm_log("processing doneeeeeeeee..... %p\n", page_desc_addr(page));
@@ -353,14 +787,13 @@ static void vsm_process_waitqueue(struct page_desc *page) {
   irqrestore(flags);
 }
 
+/* valid while I am manager of @ipa */
 static inline struct manager_page *ipa_manager_page(u64 ipa) {
-  assert(in_memrange(&cluster_me()->mem, ipa));
-
-  return manager + ((ipa - cluster_me()->mem.start) >> PAGESHIFT);
+  return &ipa_to_desc(ipa)->man;
 }
 
-/* determine manager's node of page by ipa */
-static inline int page_manager(u64 ipa) {
+/* first manager of page: node of memrange containing @ipa */
+static inline int page_home(u64 ipa) {
   struct cluster_node *node;
   foreach_cluster_node(node) {
     if(in_memrange(&node->mem, ipa))
@@ -370,6 +803,35 @@ static inline int page_manager(u64 ipa) {
   return -1;
 }
 
+/* manager of page, or node on the way to it */
+static inline int page_manager(u64 ipa) {
+  u8 m;
+
+  /* prefetcher walks off guest memory */
+  if(ipa_to_pfn(ipa) >= GVM_MEMORY / PAGESIZE)
+    return -1;
+
+  m = ipa_to_desc(ipa)->manager;
+
+  return m == VSM_NO_NODE ? -1 : m;
+}
+
+/* requester: manager hint in fetch reply, page is locked */
+static inline void vsm_manager_hint(struct fetch_reply_hdr *a) {
+  struct page_desc *page = ipa_to_desc(a->ipa);
+
+  if(a->manager != VSM_NO_NODE && page->manager != local_nodeid())
+    page->manager = a->manager;
+}
+
+/* server: manager hint for reply to @proc */
+static inline u8 vsm_reply_manager(struct vsm_server_proc *proc) {
+  if(page_manager(proc->page_ipa) == local_nodeid())
+    return local_nodeid();
+
+  return proc->manager;
+}
+
 static inline u64 *vsm_wait_for_recv_timeout(u64 page_ipa) {
   int timeout_us = 3000000;   // wait for 3s
   u64 *pte;
@@ -401,7 +863,7 @@ static u64 vsm_fetch_page_dummy(u8 dst_node, u64 page_ipa, char *buf) {
 }
 
 int vsm_fetch_and_cache_dummy(u64 page_ipa) {
-  char *page = alloc_page();
+  char *page = alloc_page_nozero();
   if(!page)
     panic("mem");
 
@@ -437,6 +899,7 @@ static void vsm_invalidate(u64 ipa, u64 copyset) {
 
   struct msg msg;
   struct invalidate_hdr hdr;
+  u64 t0 = now_cycles();
 
   hdr.ipa = ipa;
   hdr.copyset = copyset;
@@ -449,12 +912,16 @@ static void vsm_invalidate(u64 ipa, u64 copyset) {
  
       msg_init(&msg, node, MSG_INVALIDATE, &hdr, NULL, 0);
 
+      vsm_log(INV_SENDER, local_nodeid(), node, ipa, msg_connid(&msg), 0);
+
       send_msg(&msg);
     }
 
     copyset >>= 1;
     node++;
   } while(copyset);
+
+  vsm_lat_record(LAT_INV_FANOUT, now_cycles() - t0);
 }
 
 static void vsm_invalidate_server_process(struct vsm_server_proc *proc) {
@@ -465,95 +932,451 @@ static void vsm_invalidate_server_process(struct vsm_server_proc *proc) {
 
   assert(page_locked(page));
 
-  if(!s2_accessible(ipa)) {
+  pte = s2_walk(ipa);
+
+  if(!pte || !s2pte_is_accessible(pte)) {
     // panic("invalidate already: %p", ipa);
     return;
   }
 
-  if((pte = s2_rwable_pte(ipa)) != NULL ||
-      (((pte = s2_ro_pte(ipa)) != NULL) && s2pte_copyset(pte) != 0)) {
+  if(vsm_pte_owner(pte)) {
     /* I'm already owner, ignore invalidate request */
     return;
   }
 
   vmm_log("inv server %p: from %d -> %d\n", ipa, from_nodeid, local_nodeid()); 
+  vsm_log(INV_RECEIVER, from_nodeid, local_nodeid(), ipa, 0, 0);
 
   s2_page_invalidate(ipa);
+  stat_inc(&page->ninv);
+
+  vsm_block_conflict(ipa);
 }
 
-void *vsm_read_fetch_page_imm(u64 page_ipa, u64 offset, char *buf, u64 size)  {
-  struct page_desc *page = ipa_to_desc(page_ipa);
+/* lease @lease_us to readers of pages read only for @idle_us; 0 disables */
+int vsm_set_lease(u32 idle_us, u32 lease_us) {
+  if(lease_us && lease_ticks(lease_us) < VSM_LEASE_MARGIN)
+    return -1;
 
-  struct vsm_rw_data d = {
-    .offset = offset,
-    .buf = buf,
-    .size = size,
-  };
+  lease_idle = lease_ticks(idle_us);
+  lease_len = lease_ticks(lease_us);
 
-  return __vsm_read_fetch_page(page, &d);
+  return 0;
 }
 
-void *vsm_read_fetch_page(u64 page_ipa) {
-  struct page_desc *page = ipa_to_desc(page_ipa);
+static inline int region_conflict_order(struct vsm_region *r) {
+  u64 nblocks = r->size >> r->shift;
 
-  return __vsm_read_fetch_page(page, NULL);
+  return nblocks > PAGESIZE ? 64 - __builtin_clzl((nblocks - 1) >> PAGESHIFT) : 0;
 }
 
-void *vsm_read_fetch_instr(u64 page_ipa) {
-  void *p;
-  struct page_desc *page = ipa_to_desc(page_ipa);
-
-  p = __vsm_read_fetch_page(page, NULL);
-  if(!p)
-    return NULL;
+/*
+ *  read fetch [@start, @start + @size) by 1 << @shift byte block.
+ *  a region at @start is reconfigured.  before vcpus run
+ */
+int vsm_set_block_fetch(u64 start, u64 size, int shift) {
+  struct vsm_region *r, *old = NULL;
+  struct vsm_region new = {
+    .start = start,
+    .size = size,
+    .shift = shift,
+  };
 
-  guest_icache_invalidate(p, PAGESIZE);
+  if(shift != 16 && shift != 21)
+    return -1;
+  if(size == 0 || start % (1ul << shift) || size % (1ul << shift))
+    return -1;
 
-  return p;
-}
+  /* memranges of nodes are contiguous */
+  if(start + size < start || page_home(start) < 0 || page_home(start + size - 1) < 0)
+    return -1;
 
-/* read fault handler */
-static void *__vsm_read_fetch_page(struct page_desc *page, struct vsm_rw_data *d) {
-  u64 *pte;
-  u64 page_pa = 0;
-  int manager = -1;
-  u64 page_ipa = page_desc_addr(page);
+  for(r = vsm_region; r < &vsm_region[nr_vsm_region]; r++) {
+    if(r->start == start)
+      old = r;
+    else if(start < r->start + r->size && r->start < start + size)
+      return -1;
+  }
 
-  manager = page_manager(page_ipa);
-  if(manager < 0)
-    return NULL;
+  if(!old && nr_vsm_region == NR_VSM_REGION)
+    return -1;
 
-  page_spinlock(page);
+  new.conflict = alloc_pages(region_conflict_order(&new));
+  if(!new.conflict)
+    return -1;
 
-  vmm_log("read request occured: %p %p\n", page_ipa, read_sysreg(elr_el2));
+  if(old)
+    free_pages(old->conflict, region_conflict_order(old));
+  else
+    old = &vsm_region[nr_vsm_region++];
 
-  /*
-   * may other cpu has readable page already
-   */
-  if((pte = s2_readable_pte(page_ipa)) != NULL) {
-    page_pa = PTE_PA(*pte);
-    goto end;
-  }
+  *old = new;
 
-  if(manager == local_nodeid()) {   /* I am manager */
-    /* receive page from owner of page */
-    struct manager_page *p = ipa_manager_page(page_ipa);
-    int owner = p->owner;
+  printf("vsm: [%p - %p) read fetched by %d KB block\n", start, start + size, 1 << (shift - 10));
 
-    vmm_log("read req %p: %d -> %d request to owner\n", page_ipa, local_nodeid(), owner);
+  return 0;
+}
 
-    send_read_fetch_req(local_nodeid(), owner, page_ipa);
-  } else {
-    /* ask manager for read access to page and a copy of page */
-    vmm_log("read req %p: %d -> %d request to owner\n", page_ipa, local_nodeid(), manager);
+static struct vsm_region *ipa_region(u64 ipa) {
+  struct vsm_region *r;
 
-    send_read_fetch_req(local_nodeid(), manager, page_ipa);
+  for(r = vsm_region; r < &vsm_region[nr_vsm_region]; r++) {
+    if(r->start <= ipa && ipa < r->start + r->size)
+      return r;
   }
 
-  pte = s2_accessible_pte(page_ipa);
-  assert(pte);
+  return NULL;
+}
 
-  page_pa = PTE_PA(*pte);
+static inline u8 *region_block(struct vsm_region *r, u64 ipa) {
+  return &r->conflict[(ipa - r->start) >> r->shift];
+}
+
+/* read fetch block of @ipa */
+static u64 vsm_block_size(u64 ipa) {
+  struct vsm_region *r = ipa_region(ipa);
+
+  if(!r || *region_block(r, ipa) == VSM_BLOCK_DEMOTED)
+    return PAGESIZE;
+
+  return 1ul << r->shift;
+}
+
+/* a page of block moved away from this node, or is being written on its owner */
+static void vsm_block_conflict(u64 ipa) {
+  struct vsm_region *r = ipa_region(ipa);
+  u8 *c;
+
+  if(!r)
+    return;
+
+  c = region_block(r, ipa);
+
+  if(*c != VSM_BLOCK_DEMOTED && ++*c >= VSM_FALSE_SHARING) {
+    *c = VSM_BLOCK_DEMOTED;
+    vmm_log("vsm: false sharing on block %p: fall back to 4KB\n", ALIGN_DOWN(ipa, 1ul << r->shift));
+  }
+}
+
+static inline u64 batch_page_ipa(u64 base, int i) {
+  return base + ((u64)i << PAGESHIFT);
+}
+
+/* on failure, locked pages in @bitmap are unlocked */
+static int vsm_fetch_batch(u8 dst, u64 base, u32 bitmap, int flags) {
+  if(send_fetch_batch_req(dst, base, bitmap, flags) == 0)
+    return 0;
+
+  /* no room for more outstanding requests */
+  for(int i = 0; i < FETCH_BATCH_MAX; i++) {
+    if(bitmap & (1u << i))
+      vsm_process_waitqueue(ipa_to_desc(batch_page_ipa(base, i)));
+  }
+
+  return -1;
+}
+
+/*
+ *  prefetch window is locked until its replies arrive;
+ *  faults on it spin in page_spinlock() like any other in-flight fetch
+ */
+static void prefetch_window(struct vsm_prefetcher *pf, u64 page_ipa, int manager) {
+  int i, owner = -1;
+  u64 ipa, base;
+  u32 bitmap = 0;
+
+  pf->issued = 0;
+
+  if(pf->stride > 0)
+    base = page_ipa + PAGESIZE;
+  else
+    base = page_ipa - (u64)pf->window * PAGESIZE;
+
+  for(i = 1; i <= pf->window; i++) {
+    ipa = page_ipa + (i64)pf->stride * i * PAGESIZE;
+
+    if(page_manager(ipa) != manager)
+      break;
+
+    struct page_desc *page = ipa_to_desc(ipa);
+
+    /* someone is fetching it already */
+    if(page_trylock(page))
+      continue;
+
+    if(s2_accessible(ipa)) {
+      vsm_process_waitqueue(page);
+      continue;
+    }
+
+    /* I am manager: batch only pages of the same owner */
+    if(manager == local_nodeid()) {
+      int o = ipa_manager_page(ipa)->owner;
+
+      if(owner < 0)
+        owner = o;
+
+      if(o != owner) {
+        vsm_process_waitqueue(page);
+        continue;
+      }
+    }
+
+    bitmap |= 1u << ((ipa - base) >> PAGESHIFT);
+    pf->issued++;
+  }
+
+  pf->next_ipa = page_ipa + (i64)pf->stride * (i64)(i > 1 ? i : 1) * PAGESIZE;
+
+  if(!bitmap)
+    return;
+
+  int dst = manager == local_nodeid() ? owner : manager;
+
+  if(vsm_fetch_batch(dst, base, bitmap, FETCH_F_PREFETCH) < 0)
+    pf->issued = 0;
+}
+
+/*
+ *  fetch rest of coarse block of @page_ipa after read fault on it;
+ *  pages are locked until their batch completes
+ */
+static void vsm_fetch_block(u64 page_ipa, int manager) {
+  u64 bsize = vsm_block_size(page_ipa);
+  u64 start = ALIGN_DOWN(page_ipa, bsize);
+  u64 ipa, base = 0;
+  u32 bitmap = 0;
+  int dst = -1;
+
+  for(ipa = start; ipa < start + bsize; ipa += PAGESIZE) {
+    if(ipa == page_ipa || page_manager(ipa) != manager)
+      continue;
+
+    struct page_desc *page = ipa_to_desc(ipa);
+
+    if(page_trylock(page))
+      continue;
+
+    int d = manager == local_nodeid() ? ipa_manager_page(ipa)->owner : manager;
+
+    if(s2_accessible(ipa) || d == local_nodeid()) {
+      vsm_process_waitqueue(page);
+      continue;
+    }
+
+    /* flush batch: other owner or out of bitmap */
+    if(bitmap && (d != dst || ipa - base >= FETCH_BATCH_MAX * PAGESIZE)) {
+      if(vsm_fetch_batch(dst, base, bitmap, FETCH_F_PREFETCH | FETCH_F_BLOCK) < 0) {
+        vsm_process_waitqueue(page);
+        return;
+      }
+      bitmap = 0;
+    }
+
+    if(!bitmap) {
+      base = ipa;
+      dst = d;
+    }
+
+    bitmap |= 1u << ((ipa - base) >> PAGESHIFT);
+  }
+
+  if(bitmap)
+    vsm_fetch_batch(dst, base, bitmap, FETCH_F_PREFETCH | FETCH_F_BLOCK);
+}
+
+/*
+ *  neighbours of a lapsed lease are likely lapsed and read again too:
+ *  fetch them in one batch, asking for leases again
+ */
+static void vsm_lease_refetch(u64 page_ipa, int manager) {
+  u64 base = ALIGN_DOWN(page_ipa, FETCH_BATCH_MAX * PAGESIZE);
+  u32 bitmap = 0;
+  int dst = -1;
+
+  for(int i = 0; i < FETCH_BATCH_MAX; i++) {
+    u64 ipa = batch_page_ipa(base, i);
+    struct page_desc *page = ipa_to_desc(ipa);
+
+    if(ipa == page_ipa || page->lease != VSM_LEASE_LAPSED || page_manager(ipa) != manager)
+      continue;
+
+    if(page_trylock(page))
+      continue;
+
+    int d = manager == local_nodeid() ? ipa_manager_page(ipa)->owner : manager;
+
+    /* batch only pages of the same owner */
+    if(s2_accessible(ipa) || d == local_nodeid() || (dst >= 0 && d != dst) ||
+       !vsm_lease_reserve()) {
+      vsm_process_waitqueue(page);
+      continue;
+    }
+
+    page->lease = 0;
+    dst = d;
+    bitmap |= 1u << i;
+  }
+
+  if(bitmap && vsm_fetch_batch(dst, base, bitmap, FETCH_F_PREFETCH | FETCH_F_LEASE) < 0)
+    vsm_lease_cancel(__builtin_popcount(bitmap));
+}
+
+/* called after remote read fault on @page_ipa is resolved */
+static void vsm_prefetch(u64 page_ipa, int manager) {
+  struct vsm_prefetcher *pf = &prefetcher[cpuid()];
+  i64 d = ((i64)page_ipa - (i64)pf->last_ipa) / PAGESIZE;
+
+  if(pf->stride && page_ipa == pf->next_ipa) {
+    /* stream ran through prefetched window */
+    pf->hit += pf->issued;
+    pf->window = min(pf->window * 2, VSM_PREFETCH_MAX);
+  } else if(d == 1 || d == -1) {
+    if(pf->stride != d) {
+      pf->stride = d;
+      pf->window = max(pf->window, VSM_PREFETCH_MIN);
+    }
+  } else {
+    /* random access or stream broken */
+    pf->waste += pf->issued;
+    if(pf->stride)
+      pf->window = max(pf->window / 2, VSM_PREFETCH_MIN);
+    pf->stride = 0;
+  }
+
+  /* prefetched pages are mostly thrown away */
+  if(pf->waste > pf->hit * 2 + VSM_PREFETCH_MAX)
+    pf->window = VSM_PREFETCH_MIN;
+
+  pf->last_ipa = page_ipa;
+  pf->issued = 0;
+
+  if(pf->stride)
+    prefetch_window(pf, page_ipa, manager);
+}
+
+void *vsm_read_fetch_page_imm(u64 page_ipa, u64 offset, char *buf, u64 size)  {
+  struct page_desc *page = ipa_to_desc(page_ipa);
+
+  struct vsm_rw_data d = {
+    .offset = offset,
+    .buf = buf,
+    .size = size,
+  };
+
+  return __vsm_read_fetch_page(page, &d);
+}
+
+void *vsm_read_fetch_page(u64 page_ipa) {
+  struct page_desc *page = ipa_to_desc(page_ipa);
+
+  return __vsm_read_fetch_page(page, NULL);
+}
+
+void *vsm_read_fetch_instr(u64 page_ipa) {
+  void *p;
+  struct page_desc *page = ipa_to_desc(page_ipa);
+
+  p = __vsm_read_fetch_page(page, NULL);
+  if(!p)
+    return NULL;
+
+  guest_icache_invalidate(p, PAGESIZE);
+
+  return p;
+}
+
+/*
+ *  give back the contiguous hint to a 64KB run when its last page
+ *  becomes writable again.  caller holds the lock of @page_ipa.
+ */
+static void vsm_cont_try(u64 page_ipa) {
+  u64 base = ALIGN_DOWN(page_ipa, S2_CONT_SIZE);
+  int i, nlocked;
+
+  if(!s2_cont_check(page_ipa))
+    return;
+
+  for(nlocked = 0; nlocked < S2_CONT_PAGES; nlocked++) {
+    u64 ipa = base + nlocked * PAGESIZE;
+
+    if(ipa == page_ipa)
+      continue;
+    /* someone is working on it: retry at next write fault */
+    if(page_trylock(ipa_to_desc(ipa)))
+      break;
+  }
+
+  if(nlocked == S2_CONT_PAGES)
+    s2_cont_make(page_ipa);
+
+  for(i = 0; i < nlocked; i++) {
+    u64 ipa = base + i * PAGESIZE;
+
+    if(ipa != page_ipa)
+      vsm_process_waitqueue(ipa_to_desc(ipa));
+  }
+}
+
+/* read fault handler */
+static void *__vsm_read_fetch_page(struct page_desc *page, struct vsm_rw_data *d) {
+  u64 *pte;
+  u64 page_pa = 0;
+  int manager = -1;
+  u64 page_ipa = page_desc_addr(page);
+  u64 t0 = now_cycles();
+  enum vsm_lat lat;
+  int replier, flags;
+  bool lapsed;
+
+  manager = page_manager(page_ipa);
+  if(manager < 0)
+    return NULL;
+
+  page_spinlock(page);
+
+  /* may have moved while waiting for lock */
+  manager = page_manager(page_ipa);
+
+  vmm_log("read request occured: %p %p\n", page_ipa, read_sysreg(elr_el2));
+
+  /*
+   * may other cpu has readable page already
+   */
+  if(s2_readable_pte(page_ipa)) {
+    /* may be in a block mapping */
+    page_pa = ipa2pa(page_ipa);
+    goto end;
+  }
+
+  lapsed = page->lease == VSM_LEASE_LAPSED;
+  flags = vsm_lease_reserve() ? FETCH_F_LEASE : 0;
+
+  if(manager == local_nodeid()) {   /* I am manager */
+    /* receive page from owner of page */
+    struct manager_page *p = ipa_manager_page(page_ipa);
+    int owner = p->owner;
+
+    vsm_stat_manager(p, local_nodeid(), false);
+
+    vmm_log("read req %p: %d -> %d request to owner\n", page_ipa, local_nodeid(), owner);
+
+    send_read_fetch_req(local_nodeid(), owner, page_ipa, flags | FETCH_F_FWD);
+    lat = LAT_READ_2HOP;
+  } else {
+    /* ask manager for read access to page and a copy of page */
+    vmm_log("read req %p: %d -> %d request to owner\n", page_ipa, local_nodeid(), manager);
+
+    replier = send_read_fetch_req(local_nodeid(), manager, page_ipa, flags);
+    lat = replier == manager ? LAT_READ_2HOP : LAT_READ_3HOP;
+  }
+
+  stat_inc(&page->nrfetch);
+
+  pte = s2_accessible_pte(page_ipa);
+  assert(pte);
+
+  page_pa = PTE_PA(*pte);
 
   vmm_log("read req %p: get remote page! %p\n", page_ipa, page_pa);
 
@@ -561,12 +1384,30 @@ static void *__vsm_read_fetch_page(struct page_desc *page, struct vsm_rw_data *d
   if(unlikely(d))
     memcpy(d->buf, P2V(page_pa + d->offset), d->size);
 
+  /* flushed before returning to guest */
   s2pte_ro(pte);
-  tlb_s2_flush_all(page_ipa);
+  s2_tlb_gather(page_ipa, PAGESIZE);
+
+  vsm_process_waitqueue(page);
+
+  if(likely(!d)) {
+    if(lapsed)
+      vsm_lease_refetch(page_ipa, manager);
+    else if(vsm_block_size(page_ipa) > PAGESIZE)
+      vsm_fetch_block(page_ipa, manager);
+    else
+      vsm_prefetch(page_ipa, manager);
+  }
+
+  vsm_lat_record(lat, now_cycles() - t0);
+
+  return P2V(page_pa);
 
 end:
   vsm_process_waitqueue(page);
 
+  vsm_lat_record(LAT_READ_LOCAL, now_cycles() - t0);
+
   return P2V(page_pa);
 }
 
@@ -588,12 +1429,81 @@ void *vsm_write_fetch_page(u64 page_ipa) {
   return __vsm_write_fetch_page(page, NULL);
 }
 
+/*
+ *  writer: wait for leases on @page to run out without stalling readers.
+ *  page stays locked and owned by me, so requests to it queue up meanwhile:
+ *  read requests are served from the queue (copyset, no more lease),
+ *  the others keep waiting until the write is done.
+ */
+static void vsm_lease_wait(struct page_desc *page) {
+  struct vsm_server_proc *p, *p_next, *head, *defer = NULL, *last = NULL;
+  u64 flags;
+
+  assert(page_locked(page));
+
+  while(vsm_lease_running(page)) {
+    page->lwait = 1;
+
+    usleep(1);
+
+    if(!page->wq)
+      continue;
+
+    irqsave(flags);
+    vwq_lock(page);
+
+    head = page->wq->head;
+    page->wq->head = NULL;
+    page->wq->tail = NULL;
+
+    vwq_unlock(page);
+    irqrestore(flags);
+
+    for(p = head; p; p = p_next) {
+      p_next = p->next;
+
+      if(p->type == READ_FETCH) {
+        vsm_do_process(p);
+        objpool_free(&vsm_proc_pool, p);
+        continue;
+      }
+
+      p->next = NULL;
+      if(last)
+        last->next = p;
+      else
+        defer = p;
+      last = p;
+    }
+  }
+
+  page->lwait = 0;
+
+  if(!defer)
+    return;
+
+  /* put deferred ones back in front, in order of arrival */
+  irqsave(flags);
+  vwq_lock(page);
+
+  last->next = page->wq->head;
+  if(!page->wq->tail)
+    page->wq->tail = last;
+  page->wq->head = defer;
+
+  vwq_unlock(page);
+  irqrestore(flags);
+}
+
 /* write fault handler */
 static void *__vsm_write_fetch_page(struct page_desc *page, struct vsm_rw_data *d) {
   u64 *pte;
   u64 page_pa = 0;
   int manager = -1;
   u64 page_ipa = page_desc_addr(page);
+  u64 t0 = now_cycles();
+  enum vsm_lat lat = LAT_WRITE_LOCAL;
+  int replier;
   u8 copyset;
 
   manager = page_manager(page_ipa);
@@ -602,25 +1512,34 @@ static void *__vsm_write_fetch_page(struct page_desc *page, struct vsm_rw_data *
 
   page_spinlock(page);
 
+  manager = page_manager(page_ipa);
+
   vmm_log("write request occured: %p %p\n", page_ipa, read_sysreg(elr_el2));
 
   /*
    * may other cpu has readable/writable page already
    */
-  if((pte = s2_rwable_pte(page_ipa)) != NULL) {
-    page_pa = PTE_PA(*pte);
+  pte = s2_walk(page_ipa);
+
+  if(pte && s2pte_is_rwable(pte)) {
+    /* may be in a block mapping */
+    page_pa = ipa2pa(page_ipa);
     goto end;
   }
 
   assert(local_irq_enabled());
 
-  if((pte = s2_ro_pte(page_ipa)) != NULL) {
+  if(pte && s2pte_is_ro(pte)) {
+    pte = s2_split_walk(page_ipa);
+
     if((copyset = s2pte_copyset(pte)) != 0) {
       /* I am owner */
       vmm_log("write request %p: write to owner ro page %p\n", page_ipa, copyset);
 
-      /* Invalidate copyset */
-      vsm_invalidate(page_ipa, copyset);
+      vsm_lease_wait(page);
+
+      /* Invalidate copyset, grown while waiting for leases */
+      vsm_invalidate(page_ipa, s2pte_copyset(pte));
       s2pte_clear_copyset(pte);
 
       goto page_acquired;
@@ -634,35 +1553,64 @@ static void *__vsm_write_fetch_page(struct page_desc *page, struct vsm_rw_data *
     u64 pa = PTE_PA(*pte);
 
     s2pte_invalidate(pte);
-    tlb_s2_flush_all();
+    s2_tlb_gather(page_ipa, PAGESIZE);
 
-    free_page(P2V(pa));
+    s2_tlb_gather_free(P2V(pa), vsm_free_page);
   }
 
   if(manager == local_nodeid()) {   /* I am manager */
     /* receive page from owner of page */
-    struct manager_page *page = ipa_manager_page(page_ipa);
-    int owner = page->owner;
+    struct manager_page *p = ipa_manager_page(page_ipa);
+    int owner = p->owner;
+
+    vsm_stat_manager(p, local_nodeid(), true);
 
     vmm_log("write request %p: %d -> %d request to owner\n", page_ipa, local_nodeid(), owner);
 
-    send_write_fetch_req(local_nodeid(), owner, page_ipa);
+    send_write_fetch_req(local_nodeid(), owner, page_ipa, FETCH_F_FWD);
+    lat = LAT_WRITE_2HOP;
+
+    p->owner = local_nodeid();
+    page->nfwd = 0;
   } else {
     /* ask manager for write access to page and a copy of page */
     vmm_log("write request %p: %d -> %d request to manager\n", page_ipa, local_nodeid(), manager);
 
-    send_write_fetch_req(local_nodeid(), manager, page_ipa);
+    replier = send_write_fetch_req(local_nodeid(), manager, page_ipa, 0);
+    lat = replier == manager ? LAT_WRITE_2HOP : LAT_WRITE_3HOP;
   }
 
+  stat_inc(&page->nwfetch);
+
   pte = s2_accessible_pte(page_ipa);
   assert(pte);
 
   vmm_log("write request %p: get remote page!\n", page_ipa);
 
+  if(vsm_lease_running(page)) {
+    /* leases of previous owner still run: serve reads as owner of ro page meanwhile */
+    s2pte_add_copyset(pte, local_nodeid());
+    s2pte_ro(pte);
+    s2_tlb_gather(page_ipa, PAGESIZE);
+
+    vsm_lease_wait(page);
+  }
+
   vsm_invalidate(page_ipa, s2pte_copyset(pte));
   s2pte_clear_copyset(pte);
 
 page_acquired:
+  /* read reply of this page may be still on the wire */
+  if(vsm_page_tx_detach(page_ipa, pte) < 0) {
+    /* no page to copy to: stay owner of ro page, the write faults again */
+    s2pte_add_copyset(pte, local_nodeid());
+    page_pa = PTE_PA(*pte);
+
+    vsm_process_waitqueue(page);
+
+    return d ? NULL : P2V(page_pa);
+  }
+
   page_pa = PTE_PA(*pte);
   vmm_log("write request: page_pa %p\n", page_pa);
 
@@ -672,9 +1620,13 @@ page_acquired:
 
   s2pte_rw(pte);
 
+  vsm_cont_try(page_ipa);
+
 end:
   vsm_process_waitqueue(page);
 
+  vsm_lat_record(lat, now_cycles() - t0);
+
   return P2V(page_pa);
 }
 
@@ -694,63 +1646,317 @@ int vsm_access(struct vcpu *vcpu, char *buf, u64 ipa, u64 size, bool wr) {
   return pa_page ? 0 : -1;
 }
 
-static void recv_fetch_reply(struct msg *reply, void * __unused arg) {
+static void recv_fetch_reply(struct msg *reply, void *arg) {
   struct fetch_reply_hdr *a = (struct fetch_reply_hdr *)reply->hdr;
   struct fetch_reply_body *b = reply->body;
+  int *replier = arg;
+
+  *replier = reply->hdr->src_id;
   // vmm_log("recv remote ipa %p ----> pa %p\n", a->ipa, b->page);
 
   if(b) {       // recv page (and ownership)
     vsm_set_cache_fast(a->ipa, a->copyset, b->page);
+    vsm_lease_reply(a);
+    vsm_manager_hint(a);
   } else {      // recv ownership only
     assert(a->wnr);
     panic("get ownership only\n");
   }
 }
 
+/*
+ *  called per page; all pages of the batch are locked by requester
+ *  until the last one arrives, then mapped under one stage 2 tlb flush.
+ *  @reply is NULL if the rest timed out: they are left unfetched
+ */
+static void recv_fetch_batch_reply(struct msg *reply, void *arg) {
+  struct vsm_fetch_batch *batch = arg;
+  struct fetch_reply_hdr *a;
+  struct fetch_reply_body *b;
+  u64 *pte;
+  int i;
+
+  if(!reply) {
+    if(batch->flags & FETCH_F_LEASE)
+      vsm_lease_cancel(__builtin_popcount(batch->pending));
+
+    batch->pending = 0;
+    goto done;
+  }
+
+  a = (struct fetch_reply_hdr *)reply->hdr;
+  b = reply->body;
+
+  assert(page_locked(ipa_to_desc(a->ipa)));
+
+  vsm_manager_hint(a);
+
+  if(b) {
+    vsm_set_cache_fast(a->ipa, a->copyset, b->page);
+
+    pte = s2_accessible_pte(a->ipa);
+    s2pte_ro(pte);
+
+    vsm_lease_reply(a);
+  } else if(batch->flags & FETCH_F_PREFETCH) {
+    /* owner declined */
+    if(batch->flags & FETCH_F_LEASE)
+      vsm_lease_reply(a);
+    else if(batch->flags & FETCH_F_BLOCK)
+      vsm_block_conflict(a->ipa);   /* written on owner: block is shared falsely */
+    else
+      prefetcher[cpuid()].waste++;
+  } else {
+    panic("batch fetch: no page %p", a->ipa);
+  }
+
+  batch->pending &= ~(1u << ((a->ipa - batch->ipa) >> PAGESHIFT));
+  if(batch->pending)
+    return;
+
+done:
+  s2_tlb_gather(batch->ipa, (u64)(32 - __builtin_clz(batch->bitmap)) << PAGESHIFT);
+  s2_tlb_flush_gathered();
+
+  for(i = 0; i < FETCH_BATCH_MAX; i++) {
+    if(batch->bitmap & (1u << i))
+      vsm_process_waitqueue(ipa_to_desc(batch_page_ipa(batch->ipa, i)));
+  }
+
+  objpool_free(&vsm_batch_pool, batch);
+}
+
+/*
+ *  fetch pages in @bitmap from @dst asynchronously
+ *  pages must be locked by caller, and are unlocked when all replies arrive
+ */
+static int send_fetch_batch_req(u8 dst, u64 ipa, u32 bitmap, int flags) {
+  struct msg msg;
+  struct fetch_batch_req_hdr hdr;
+  struct vsm_fetch_batch *batch;
+
+  batch = objpool_alloc(&vsm_batch_pool);
+  batch->ipa = ipa;
+  batch->bitmap = bitmap;
+  batch->pending = bitmap;
+  batch->flags = flags;
+
+  hdr.ipa = ipa;
+  hdr.bitmap = bitmap;
+  hdr.req_nodeid = local_nodeid();
+  hdr.type = READ_FETCH;
+  hdr.flags = flags;
+
+  msg_init(&msg, dst, MSG_FETCH_BATCH, &hdr, NULL, 0);
+  msg.nreply = __builtin_popcount(bitmap);
+
+  if(send_msg_async(&msg, recv_fetch_batch_reply, batch) < 0) {
+    objpool_free(&vsm_batch_pool, batch);
+    return -1;
+  }
+
+  return 0;
+}
+
 /*
  *  @req: request nodeid
  *  @dst: fetch request destination
+ *  @connid: connection of forwarded request (ignored if @waitreply)
  */
-static void send_fetch_req(u8 req, u8 dst, u64 ipa, enum fetch_type type,
-                           bool waitreply, int req_cpu) {
+/*
+ *  return node replied if @waitreply: manager, or owner if forwarded
+ */
+static int send_fetch_req(u8 req, u8 dst, u64 ipa, enum fetch_type type,
+                          int flags, bool waitreply, u32 connid) {
   struct msg msg;
   struct fetch_req_hdr hdr;
+  int wr = type == WRITE_FETCH;
+  int replier = -1;
+  u64 t0;
 
   hdr.ipa = ipa;
   hdr.req_nodeid = req;
   hdr.type = type;
-
-  msg_init_reqcpu(&msg, dst, MSG_FETCH, &hdr, NULL, 0, req_cpu);
+  hdr.flags = flags;
 
   if(waitreply) {
-    send_msg_cb(&msg, recv_fetch_reply, NULL);
+    msg_init(&msg, dst, MSG_FETCH, &hdr, NULL, 0);
+
+    vsm_log(wr ? WRITE_SENDER : READ_SENDER, req, dst, ipa, msg_connid(&msg), 0);
+    t0 = now_cycles();
+
+    send_msg_cb(&msg, recv_fetch_reply, &replier);
+
+    vsm_log(wr ? WRITE_DONE : READ_DONE, req, dst, ipa, msg_connid(&msg),
+            now_cycles() - t0);
   } else {
+    /* owner replies directly to requester with the original connection */
+    msg_init_conn(&msg, dst, MSG_FETCH, &hdr, NULL, 0, connid);
+
+    vsm_log(wr ? WRITE_SENDER : READ_SENDER, req, dst, ipa, connid, 0);
+
     send_msg(&msg);
   }
+
+  return replier;
+}
+
+static struct vsm_txhold *txhold_lookup(void *page) {
+  struct vsm_txhold *h;
+
+  for(h = txhold; h < &txhold[VSM_TXHOLD_MAX]; h++) {
+    if(h->page == page)
+      return h;
+  }
+
+  return NULL;
+}
+
+/* return false if no room to hold @page */
+static bool vsm_page_hold(void *page) {
+  struct vsm_txhold *h;
+  u64 flags;
+
+  spin_lock_irqsave(&txhold_lock, flags);
+
+  if(!(h = txhold_lookup(page)) && (h = txhold_lookup(NULL)) != NULL) {
+    h->page = page;
+    h->ref = 0;
+    h->dead = false;
+  }
+
+  if(h)
+    h->ref++;
+
+  spin_unlock_irqrestore(&txhold_lock, flags);
+
+  return h != NULL;
+}
+
+/* called on tx completion */
+static void vsm_page_unhold(void *page) {
+  struct vsm_txhold *h;
+  bool dead = false;
+  u64 flags;
+
+  spin_lock_irqsave(&txhold_lock, flags);
+
+  h = txhold_lookup(page);
+  if(!h)
+    panic("unhold %p", page);
+
+  if(--h->ref == 0) {
+    dead = h->dead;
+    h->page = NULL;
+  }
+
+  spin_unlock_irqrestore(&txhold_lock, flags);
+
+  if(dead)
+    free_page(page);
+}
+
+/* free guest page unmapped from stage 2 */
+static void vsm_free_page(void *page) {
+  struct vsm_txhold *h;
+  u64 flags;
+
+  spin_lock_irqsave(&txhold_lock, flags);
+
+  h = txhold_lookup(page);
+  if(h)
+    h->dead = true;
+
+  spin_unlock_irqrestore(&txhold_lock, flags);
+
+  if(!h)
+    free_page(page);
+}
+
+static bool vsm_page_held(void *page) {
+  struct vsm_txhold *h;
+  u64 flags;
+
+  spin_lock_irqsave(&txhold_lock, flags);
+  h = txhold_lookup(page);
+  spin_unlock_irqrestore(&txhold_lock, flags);
+
+  return h != NULL;
+}
+
+/*
+ *  a reply still on the wire may read the page of @pte: move the mapping
+ *  to a copy before writing in place.  the old one is freed by
+ *  vsm_free_page() on its last tx completion.
+ *  must be held page lock; no new reply of the page starts under it.
+ *  return -1 if no page to copy to
+ */
+static int vsm_page_tx_detach(u64 ipa, u64 *pte) {
+  void *old = P2V(PTE_PA(*pte));
+  void *new;
+  u64 copyset = s2pte_copyset(pte);
+
+  if(!vsm_page_held(old))
+    return 0;
+
+  new = alloc_page_nozero();
+  if(!new)
+    return -1;
+
+  memcpy(new, old, PAGESIZE);
+
+  /* other cpus may read the old page until the break is flushed */
+  s2pte_invalidate(pte);
+  s2_tlb_gather(ipa, PAGESIZE);
+  s2_tlb_gather_free(old, vsm_free_page);
+  s2_tlb_flush_gathered();
+
+  s2_map_page_copyset(ipa, V2P(new), copyset);
+  s2pte_ro(pte);
+
+  return 0;
+}
+
+/* reference @page from reply without copy if possible */
+static inline void fetch_reply_nocopy(struct msg *msg, void *page) {
+  if(vsm_page_hold(page))
+    msg->body_free = vsm_page_unhold;
 }
 
-static void send_read_fetch_reply(u8 dst_nodeid, u64 ipa, void *page, int req_cpu) {
+static void send_read_fetch_reply(u8 dst_nodeid, u64 ipa, void *page, int flags,
+                                  u32 lease, u8 manager, u32 connid) {
   struct msg msg;
   struct fetch_reply_hdr hdr;
 
   hdr.ipa = ipa;
   hdr.wnr = 0;
   hdr.copyset = 0;
+  hdr.flags = flags;
+  hdr.lease = lease;
+  hdr.manager = manager;
 
-  msg_init_reqcpu(&msg, dst_nodeid, MSG_FETCH_REPLY, &hdr, page, PAGESIZE, req_cpu);
+  if(page) {
+    msg_init_conn(&msg, dst_nodeid, MSG_FETCH_REPLY, &hdr, page, PAGESIZE, connid);
+    fetch_reply_nocopy(&msg, page);
+  } else {
+    msg_init_conn(&msg, dst_nodeid, MSG_FETCH_REPLY, &hdr, NULL, 0, connid);
+  }
   vmm_log("send read fetch reply %p\n", page);
 
   send_msg(&msg);
 }
 
-static void send_write_fetch_reply(u8 dst_nodeid, u64 ipa, void *page,
-                                   bool send_page, u8 copyset, int req_cpu) {
+static void send_write_fetch_reply(u8 dst_nodeid, u64 ipa, void *page, bool send_page,
+                                   u8 copyset, u32 lease, u8 manager, u32 connid) {
   struct msg msg;
   struct fetch_reply_hdr hdr;
 
   hdr.ipa = ipa;
   hdr.wnr = 1;
   hdr.copyset = copyset;
+  hdr.flags = 0;
+  hdr.lease = lease;
+  hdr.manager = manager;
 
   /*
   if(ipa == 0x406c2000) {
@@ -759,14 +1965,37 @@ static void send_write_fetch_reply(u8 dst_nodeid, u64 ipa, void *page,
   }
   */
 
-  if(send_page)
-    msg_init_reqcpu(&msg, dst_nodeid, MSG_FETCH_REPLY, &hdr, page, PAGESIZE, req_cpu);
-  else
-    msg_init_reqcpu(&msg, dst_nodeid, MSG_FETCH_REPLY, &hdr, NULL, 0, req_cpu);
+  if(send_page) {
+    msg_init_conn(&msg, dst_nodeid, MSG_FETCH_REPLY, &hdr, page, PAGESIZE, connid);
+    fetch_reply_nocopy(&msg, page);
+  } else {
+    msg_init_conn(&msg, dst_nodeid, MSG_FETCH_REPLY, &hdr, NULL, 0, connid);
+  }
 
   send_msg(&msg);
 }
 
+/*
+ *  hand managership of page over to @owner; requests coming to me later
+ *  follow it over the same link
+ */
+static void vsm_manager_migrate(struct page_desc *page, u64 ipa, int owner) {
+  struct msg msg;
+  struct manager_hdr hdr;
+
+  hdr.ipa = ipa;
+
+  msg_init(&msg, owner, MSG_MANAGER, &hdr, NULL, 0);
+
+  vmm_log("vsm: manager of %p: %d -> %d\n", ipa, local_nodeid(), owner);
+
+  send_msg(&msg);
+
+  page->manager = owner;
+  page->nfwd = 0;
+  manager_migrated++;
+}
+
 /* read server */
 static void vsm_read_server_process(struct vsm_server_proc *proc) {
   u64 page_ipa = proc->page_ipa;
@@ -780,13 +2009,41 @@ static void vsm_read_server_process(struct vsm_server_proc *proc) {
   if(manager < 0)
     panic("dare");
 
-  if((pte = s2_rwable_pte(page_ipa)) != NULL ||
-      (((pte = s2_ro_pte(page_ipa)) != NULL) && s2pte_copyset(pte) != 0)) {
+  if(local_nodeid() == manager)
+    vsm_stat_manager(ipa_manager_page(page_ipa), req_nodeid, false);
+
+  vsm_log(READ_RECEIVER, req_nodeid, local_nodeid(), page_ipa, proc->req_connid, 0);
+
+  pte = s2_walk(page_ipa);
+
+  if((proc->flags & FETCH_F_PREFETCH) && pte && s2pte_is_rwable(pte)) {
+    /* don't take write permission away from owner for speculative read */
+    vmm_log("read server %p: decline prefetch from %d\n", page_ipa, req_nodeid);
+
+    send_read_fetch_reply(req_nodeid, page_ipa, NULL, proc->flags, 0,
+                          vsm_reply_manager(proc), proc->req_connid);
+    return;
+  }
+
+  if(pte && vsm_pte_owner(pte)) {
+    u32 lease;
+
+    pte = s2_split_walk(page_ipa);
+
+    if(s2pte_is_rwable(pte))
+      page->rosince = lease_clock();
+
+    /* reply carries the page: no writer may remain */
+    s2_cont_split(pte, page_ipa);
     s2pte_ro(pte);
-    tlb_s2_flush_ipa(page_ipa);
+    s2_tlb_gather(page_ipa, PAGESIZE);
+    s2_tlb_flush_gathered();
 
-    /* copyset = copyset | request node */
-    s2pte_add_copyset(pte, req_nodeid);
+    /* copyset = copyset | request node, or lease it */
+    if((lease = vsm_lease_grant(page, proc->flags)) == 0)
+      s2pte_add_copyset(pte, req_nodeid);
+    else    /* keep me owner of ro page */
+      s2pte_add_copyset(pte, local_nodeid());
 
     /* I am owner */
     u64 pa = PTE_PA(*pte);
@@ -794,7 +2051,8 @@ static void vsm_read_server_process(struct vsm_server_proc *proc) {
     vmm_log("read server %p: %d -> %d: I am owner!\n", page_ipa, req_nodeid, local_nodeid());
 
     /* send p */
-    send_read_fetch_reply(req_nodeid, page_ipa, P2V(pa), proc->req_cpu);
+    send_read_fetch_reply(req_nodeid, page_ipa, P2V(pa), proc->flags, lease,
+                          vsm_reply_manager(proc), proc->req_connid);
   } else if(local_nodeid() == manager) {  /* I am manager */
     struct manager_page *p = ipa_manager_page(page_ipa);
     int p_owner = p->owner;
@@ -805,7 +2063,16 @@ static void vsm_read_server_process(struct vsm_server_proc *proc) {
       panic("read server: req_nodeid(%d) == p_owner(%d)", req_nodeid, p_owner);
 
     /* forward request to p's owner */
-    forward_read_fetch_req(req_nodeid, p_owner, page_ipa, proc->req_cpu);
+    forward_read_fetch_req(req_nodeid, p_owner, page_ipa, proc->flags | FETCH_F_FWD,
+                           proc->req_connid);
+
+    /* owner keeps the page: let it serve without me */
+    if(++page->nfwd >= VSM_MIGRATE_FWD)
+      vsm_manager_migrate(page, page_ipa, p_owner);
+  } else if(!(proc->flags & FETCH_F_FWD)) {
+    vmm_log("read server %p: %d -> %d: forward to next manager\n", page_ipa, req_nodeid, manager);
+
+    forward_read_fetch_req(req_nodeid, manager, page_ipa, proc->flags, proc->req_connid);
   } else {
     printf("read server: read %p (manager %d) from Node %d", page_ipa, manager, req_nodeid);
     panic("unreachable");
@@ -826,14 +2093,26 @@ static void vsm_write_server_process(struct vsm_server_proc *proc) {
   if(manager < 0)
     panic("dare w");
 
-  if((pte = s2_rwable_pte(page_ipa)) != NULL ||
-      (((pte = s2_ro_pte(page_ipa)) != NULL) && s2pte_copyset(pte) != 0)) {
+  if(local_nodeid() == manager)
+    vsm_stat_manager(ipa_manager_page(page_ipa), req_nodeid, true);
+
+  vsm_log(WRITE_RECEIVER, req_nodeid, local_nodeid(), page_ipa, proc->req_connid, 0);
+
+  pte = s2_walk(page_ipa);
+
+  /* ownership moves only through manager */
+  if(pte && vsm_pte_owner(pte) &&
+     (local_nodeid() == manager || (proc->flags & FETCH_F_FWD))) {
+    pte = s2_split_walk(page_ipa);
+
     /* I am owner */
     u64 pa = PTE_PA(*pte);
-    u64 copyset = s2pte_copyset(pte);
+    u64 copyset = s2pte_copyset(pte) & ~(1 << local_nodeid());
 
+    s2_cont_split(pte, page_ipa);
     s2pte_invalidate(pte);
-    tlb_s2_flush_ipa(page_ipa);
+    s2_tlb_gather(page_ipa, PAGESIZE);
+    s2_tlb_flush_gathered();
 
     vmm_log("write server %p %d -> %d I am owner! copyset %p\n",
             page_ipa, req_nodeid, local_nodeid(), copyset);
@@ -844,15 +2123,18 @@ static void vsm_write_server_process(struct vsm_server_proc *proc) {
     */
 
     // send p and copyset;
-    send_write_fetch_reply(req_nodeid, page_ipa, P2V(pa), send_page,
-                           copyset, proc->req_cpu);
+    send_write_fetch_reply(req_nodeid, page_ipa, P2V(pa), send_page, copyset,
+                           vsm_lease_left(page), vsm_reply_manager(proc), proc->req_connid);
 
-    free_page(P2V(pa));
+    vsm_free_page(P2V(pa));
+
+    vsm_block_conflict(page_ipa);
 
     if(local_nodeid() == manager) {
       struct manager_page *p = ipa_manager_page(page_ipa);
 
       p->owner = req_nodeid;
+      page->nfwd = 0;
     }
   } else if(local_nodeid() == manager) {
     struct manager_page *p = ipa_manager_page(page_ipa);
@@ -865,21 +2147,22 @@ static void vsm_write_server_process(struct vsm_server_proc *proc) {
               req_nodeid, p_owner);
 
     /* forward request to p's owner */
-    forward_write_fetch_req(req_nodeid, p_owner, page_ipa, proc->req_cpu);
+    forward_write_fetch_req(req_nodeid, p_owner, page_ipa, FETCH_F_FWD, proc->req_connid);
 
     /* now owner is request node */
     p->owner = req_nodeid;
+    page->nfwd = 0;
+  } else if(!(proc->flags & FETCH_F_FWD)) {
+    vmm_log("write server %p %d -> %d forward to next manager\n", page_ipa, req_nodeid, manager);
+
+    forward_write_fetch_req(req_nodeid, manager, page_ipa, 0, proc->req_connid);
   } else {
     panic("write server: %p (manager %d) %d unreachable", page_ipa, manager, req_nodeid);
   }
 }
 
-static void recv_fetch_request_intr(struct msg *msg) {
-  struct fetch_req_hdr *a = (struct fetch_req_hdr *)msg->hdr;
-  struct vsm_server_proc *p = new_vsm_server_proc(a->ipa, a->req_nodeid,
-                                                  a->type, msg_cpu(msg));
-
-  struct page_desc *page = ipa_to_desc(a->ipa);
+static void vsm_serve(struct vsm_server_proc *p) {
+  struct page_desc *page = ipa_to_desc(p->page_ipa);
 
   if(page_trylock(page)) {
     bool proc_myself = vsm_enqueue_proc(p);
@@ -889,11 +2172,41 @@ static void recv_fetch_request_intr(struct msg *msg) {
     return;
   }
 
-  p->do_process(p);
-  free(p);
+  vsm_do_process(p);
+  objpool_free(&vsm_proc_pool, p);
   vsm_process_waitqueue(page);
 }
 
+static void recv_fetch_request_intr(struct msg *msg) {
+  struct fetch_req_hdr *a = (struct fetch_req_hdr *)msg->hdr;
+  struct vsm_server_proc *p = new_vsm_server_proc(a->ipa, a->req_nodeid,
+                                                  a->type, a->flags, msg_connid(msg));
+
+  if(a->flags & FETCH_F_FWD)
+    p->manager = msg->hdr->src_id;
+
+  vsm_serve(p);
+}
+
+/* serve each page of batch as an individual fetch on the same connection */
+static void recv_fetch_batch_request_intr(struct msg *msg) {
+  struct fetch_batch_req_hdr *a = (struct fetch_batch_req_hdr *)msg->hdr;
+  struct vsm_server_proc *p;
+
+  if(a->type != READ_FETCH)
+    panic("batch fetch: read only");
+
+  for(int i = 0; i < FETCH_BATCH_MAX; i++) {
+    if(!(a->bitmap & (1u << i)))
+      continue;
+
+    p = new_vsm_server_proc(batch_page_ipa(a->ipa, i), a->req_nodeid,
+                            a->type, a->flags, msg_connid(msg));
+
+    vsm_serve(p);
+  }
+}
+
 static void recv_invalidate_intr(struct msg *msg) {
   struct invalidate_hdr *h = (struct invalidate_hdr *)msg->hdr;
   struct vsm_server_proc *p = new_vsm_inv_server_proc(h->ipa, h->from_nodeid, h->copyset);
@@ -908,32 +2221,235 @@ static void recv_invalidate_intr(struct msg *msg) {
     return;
   }
 
-  p->do_process(p);
-  free(p);
+  vsm_do_process(p);
+  objpool_free(&vsm_proc_pool, p);
   vsm_process_waitqueue(page);
 }
 
+static void vsm_lease_server_process(struct vsm_server_proc *proc) {
+  u64 ipa = proc->page_ipa;
+  struct page_desc *page = ipa_to_desc(ipa);
+  u64 *pte;
+
+  assert(page_locked(page));
+
+  /* fetched again or written since */
+  if(page->lease != proc->lease)
+    return;
+
+  page->lease = VSM_LEASE_LAPSED;
+
+  pte = s2_walk(ipa);
+  if(!pte || !s2pte_is_accessible(pte) || vsm_pte_owner(pte))
+    return;
+
+  s2_page_invalidate(ipa);
+  lease_expired++;
+}
+
+/*
+ *  drop leased copies running out; called at the tail of irq like
+ *  do_recv_waitqueue(), so a vcpu never resumes with an expired lease
+ */
+void vsm_lease_expire() {
+  struct vsm_lease l;
+  u32 now = lease_clock();
+  u64 flags;
+
+  assert(local_irq_disabled());
+
+  /* called on every irq: leases off and none left to drop */
+  if(!lease_len && !nlease)
+    return;
+
+  if(lease_head == lease_tail || lease_after(lease_ring[lease_head % VSM_LEASE_MAX].expire, now)) {
+    /* another cpu may have taken the head armed here */
+    vsm_lease_arm();
+    return;
+  }
+
+  local_irq_enable();
+
+  for(;;) {
+    spin_lock_irqsave(&lease_lock, flags);
+
+    if(lease_head == lease_tail ||
+       lease_after(lease_ring[lease_head % VSM_LEASE_MAX].expire, now)) {
+      vsm_lease_arm();
+      spin_unlock_irqrestore(&lease_lock, flags);
+      break;
+    }
+
+    l = lease_ring[lease_head % VSM_LEASE_MAX];
+    lease_head++;
+    nlease--;
+
+    spin_unlock_irqrestore(&lease_lock, flags);
+
+    vsm_serve(new_vsm_lease_server_proc(l.ipa, l.expire));
+  }
+
+  local_irq_disable();
+
+  s2_tlb_flush_gathered();
+}
+
+static void vsm_manager_server_process(struct vsm_server_proc *proc) {
+  u64 ipa = proc->page_ipa;
+  struct page_desc *page = ipa_to_desc(ipa);
+  struct manager_page *p = &page->man;
+  u64 *pte;
+
+  assert(page_locked(page));
+
+  /* old manager moves managership only to owner, and ownership only while manager */
+  pte = s2_walk(ipa);
+  vmm_bug_on(!pte || !vsm_pte_owner(pte), "manager of %p from %d: not owner", ipa,
+             proc->req_nodeid);
+
+  page->manager = local_nodeid();
+  page->nfwd = 0;
+
+  p->owner = local_nodeid();
+  p->last_req = VSM_NO_REQ;
+  p->nowner = 0;
+}
+
+static void recv_manager_intr(struct msg *msg) {
+  struct manager_hdr *h = (struct manager_hdr *)msg->hdr;
+
+  vsm_serve(new_vsm_manager_server_proc(h->ipa, msg->hdr->src_id));
+}
+
+#define VSM_STAT_TOPMAX     32
+
+/* how often the page moved between nodes, seen from this node */
+static u32 vsm_page_heat(u64 ipa) {
+  struct page_desc *page = ipa_to_desc(ipa);
+  u32 heat = page->nrfetch + page->nwfetch + page->ninv;
+
+  if(page->manager == local_nodeid())
+    heat += page->man.nowner;
+
+  return heat;
+}
+
+/*
+ *  top @n hottest pages
+ *  a page written by several nodes shows up with high w/inv/own counts,
+ *  which usually means false sharing in guest
+ */
+void vsm_statdump(int n) {
+  struct {
+    u64 ipa;
+    u32 heat;
+  } top[VSM_STAT_TOPMAX];
+  u64 nr = 0, nw = 0, ninv = 0;
+  int ntop = 0, i;
+
+  /* from guest */
+  if(n <= 0)
+    return;
+  if(n > VSM_STAT_TOPMAX)
+    n = VSM_STAT_TOPMAX;
+
+  for(struct page_desc *page = ptable; page < &ptable[GVM_MEMORY / PAGESIZE]; page++) {
+    u64 ipa = page_desc_addr(page);
+    u32 heat = vsm_page_heat(ipa);
+
+    nr += page->nrfetch;
+    nw += page->nwfetch;
+    ninv += page->ninv;
+
+    if(heat == 0 || (ntop == n && heat <= top[n - 1].heat))
+      continue;
+
+    /* insertion sort */
+    if(ntop < n)
+      ntop++;
+
+    for(i = ntop - 1; i > 0 && top[i - 1].heat < heat; i--)
+      top[i] = top[i - 1];
+
+    top[i].ipa = ipa;
+    top[i].heat = heat;
+  }
+
+  printf("vsm stat Node %d: read fetch %d write fetch %d invalidated %d\n",
+         local_nodeid(), (int)nr, (int)nw, (int)ninv);
+  printf("vsm manager Node %d: migrated %d\n", local_nodeid(), (int)manager_migrated);
+  if(lease_len)
+    printf("vsm lease Node %d: held %d granted %d expired %d\n",
+           local_nodeid(), (int)(lease_tail - lease_head), (int)lease_granted,
+           (int)lease_expired);
+  printf("ipa                  heat rfetch wfetch    inv    own owner last\n");
+
+  for(i = 0; i < ntop; i++) {
+    struct page_desc *page = ipa_to_desc(top[i].ipa);
+
+    printf("%18p %6d %6d %6d %6d ",
+           top[i].ipa, top[i].heat, page->nrfetch, page->nwfetch, page->ninv);
+
+    if(page->manager == local_nodeid()) {
+      struct manager_page *p = &page->man;
+
+      printf("%6d %5d ", p->nowner, p->owner);
+      if(p->last_req == VSM_NO_REQ)
+        printf("   -\n");
+      else
+        printf("%4d\n", p->last_req);
+    } else {
+      printf("     -     -    -\n");
+    }
+  }
+}
+
+void vsm_statreset() {
+  struct page_desc *page;
+
+  for(page = ptable; page < &ptable[GVM_MEMORY / PAGESIZE]; page++) {
+    page->nrfetch = 0;
+    page->nwfetch = 0;
+    page->ninv = 0;
+    page->man.nowner = 0;
+    page->man.last_req = VSM_NO_REQ;
+  }
+
+  lease_granted = 0;
+  lease_expired = 0;
+  manager_migrated = 0;
+}
+
 void vsm_node_init(struct memrange *mem) {
   u64 start = mem->start, size = mem->size;
-  u64 p;
 
-  for(p = 0; p < size; p += PAGESIZE) {
-    char *page = alloc_page();
-    if(!page)
-      panic("ram");
+  /* mapped by block; vsm splits it when a page moves */
+  alloc_guestmem(start, size);
 
-    guest_map_page(start + p, V2P(page), PAGE_NORMAL | PAGE_RW);
+  for(int i = 0; vsm_block_fetch_config[i].size; i++) {
+    if(vsm_set_block_fetch(vsm_block_fetch_config[i].start, vsm_block_fetch_config[i].size,
+                           vsm_block_fetch_config[i].shift) < 0)
+      vmm_warn("vsm: invalid block fetch config %d\n", i);
   }
 
-  vmm_log("Node %d mapped: [%p - %p]\n", local_nodeid(), start, start+p);
+  if(VSM_LEASE_US && vsm_set_lease(VSM_LEASE_IDLE_US, VSM_LEASE_US) < 0)
+    vmm_warn("vsm: invalid lease config\n");
+
+  vmm_log("Node %d mapped: [%p - %p]\n", local_nodeid(), start, start+size);
+
+  struct page_desc *page;
+  for(page = ptable; page < &ptable[GVM_MEMORY / PAGESIZE]; page++) {
+    int home = page_home(page_desc_addr(page));
 
-  struct manager_page *page;
-  for(page = manager; page < &manager[NR_MANAGER_PAGES]; page++) {
-    /* now owner is me */
-    page->owner = local_nodeid();
+    page->manager = home < 0 ? VSM_NO_NODE : home;
+    /* now owner of my pages is me */
+    page->man.owner = home;
+    page->man.last_req = VSM_NO_REQ;
   }
 }
 
 DEFINE_POCV2_MSG(MSG_FETCH, struct fetch_req_hdr, recv_fetch_request_intr);
 DEFINE_POCV2_MSG(MSG_FETCH_REPLY, struct fetch_reply_hdr, NULL);
+DEFINE_POCV2_MSG(MSG_FETCH_BATCH, struct fetch_batch_req_hdr, recv_fetch_batch_request_intr);
 DEFINE_POCV2_MSG(MSG_INVALIDATE, struct invalidate_hdr, recv_invalidate_intr);
+DEFINE_POCV2_MSG(MSG_MANAGER, struct manager_hdr, recv_manager_intr);
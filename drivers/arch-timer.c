@@ -4,21 +4,94 @@
 
 #include "arch-timer.h"
 #include "aarch64.h"
+#include "param.h"
 #include "printf.h"
 #include "irq.h"
+#include "localnode.h"
 
 #define CNTHP_CTL_EL2_ENABLE    (1ul << 0)
 #define CNTHP_CTL_EL2_IMASK     (1ul << 1)
 #define CNTHP_CTL_EL2_ISTATUS   (1ul << 2)
 
+/*
+ *  a deadline passed fires again every HYP_TIMER_REPEAT_US until its user
+ *  disarms or moves it: work done at the tail of irq is not lost when
+ *  the tick comes in lazyirq
+ */
+#define HYP_TIMER_REPEAT_US     20
+
 static u64 cpu_hz;
 
+/* 0: not armed */
+static u64 hyp_deadline[NCPU_MAX][NR_HYP_TIMER];
+
+u64 usec_to_cycles(u64 us) {
+  return cpu_hz * us / 1000000;
+}
+
+/* irq disabled */
+static void hyp_timer_program() {
+  u64 *d = hyp_deadline[cpuid()];
+  u64 next = 0;
+
+  for(int i = 0; i < NR_HYP_TIMER; i++) {
+    if(d[i] && (!next || d[i] < next))
+      next = d[i];
+  }
+
+  if(next) {
+    write_sysreg(cnthp_cval_el2, next);
+    write_sysreg(cnthp_ctl_el2, CNTHP_CTL_EL2_ENABLE);
+  } else {
+    write_sysreg(cnthp_ctl_el2, CNTHP_CTL_EL2_IMASK | CNTHP_CTL_EL2_ENABLE);
+  }
+
+  isb();
+}
+
 static void hyp_timer_intr(void *arg) {
+  u64 *d = hyp_deadline[cpuid()];
+  u64 now = now_cycles();
+
   (void)arg;
+
+  for(int i = 0; i < NR_HYP_TIMER; i++) {
+    if(d[i] && d[i] <= now)
+      d[i] = now + usec_to_cycles(HYP_TIMER_REPEAT_US);
+  }
+
+  hyp_timer_program();
+}
+
+/* raise hyp timer interrupt on this cpu at @deadline (in cycles) */
+void hyp_timer_arm(enum hyp_timer_slot slot, u64 deadline) {
+  u64 flags;
+
+  irqsave(flags);
+
+  if(hyp_deadline[cpuid()][slot] != deadline) {
+    hyp_deadline[cpuid()][slot] = deadline ? deadline : 1;
+    hyp_timer_program();
+  }
+
+  irqrestore(flags);
+}
+
+void hyp_timer_disarm(enum hyp_timer_slot slot) {
+  u64 flags;
+
+  irqsave(flags);
+
+  if(hyp_deadline[cpuid()][slot]) {
+    hyp_deadline[cpuid()][slot] = 0;
+    hyp_timer_program();
+  }
+
+  irqrestore(flags);
 }
 
 void usleep(int us) {
-  u64 clk = now_cycles() + cpu_hz * us / 1000000;
+  u64 clk = now_cycles() + usec_to_cycles(us);
 
   while(now_cycles() < clk)
     ;
@@ -28,11 +101,14 @@ void arch_timer_init_core() {
   u64 ctl = CNTHP_CTL_EL2_IMASK | CNTHP_CTL_EL2_ENABLE;
 
   write_sysreg(cnthp_ctl_el2, ctl);
+
+  /* hyp timer is PPI: banked per cpu, enable it on each one */
+  localnode.irqchip->enable_irq(HYP_TIMER_IRQ);
 }
 
 void arch_timer_init() {
   cpu_hz = read_sysreg(cntfrq_el0);
   printf("CPU %d Hz\n", cpu_hz);
 
-  irq_register(26, hyp_timer_intr, NULL);
+  irq_register(HYP_TIMER_IRQ, hyp_timer_intr, NULL);
 }
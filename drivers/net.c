@@ -52,6 +52,8 @@ static struct iobuf *alloc_iobuf_pages(u32 size, u32 headsize) {
 
   buf->body = NULL;
   buf->body_len = 0;
+  buf->body_order = 0;
+  buf->body_free = NULL;
   buf->npages = npages;
 
   return buf;
@@ -79,6 +81,8 @@ struct iobuf *alloc_iobuf_headsize(u32 size, u32 headsize) {
 
   buf->body = NULL;
   buf->body_len = 0;
+  buf->body_order = 0;
+  buf->body_free = NULL;
   buf->npages = 0;
 
   return buf;
@@ -92,12 +96,47 @@ void free_iobuf(struct iobuf *buf) {
   else
     free(buf->head);
 
-  if(buf->body)
-    free_page(buf->body);
+  if(buf->body && buf->body_free)
+    buf->body_free(buf->body);
+  else if(buf->body)
+    free_pages(buf->body, buf->body_order);
 
   free(buf);
 }
 
+/* body is physically contiguous pages */
+void *iobuf_alloc_body(struct iobuf *buf, u32 len) {
+  int npages = (len + PAGESIZE - 1) >> PAGESHIFT;
+  int order = npages > 1 ? fls(npages - 1) : 0;
+
+  buf->body = alloc_pages_nozero(order);
+  if(!buf->body)
+    return NULL;
+
+  buf->body_len = len;
+  buf->body_order = order;
+
+  return buf->body;
+}
+
+/*
+ *  hand body pages over to caller;
+ *  pages beyond body_len are returned to allocator
+ */
+void *iobuf_take_body(struct iobuf *buf) {
+  void *body = buf->body;
+  u32 used = (buf->body_len + PAGESIZE - 1) >> PAGESHIFT;
+
+  for(u32 i = used ? used : 1; i < (1u << buf->body_order); i++)
+    free_page((u8 *)body + (i << PAGESHIFT));
+
+  buf->body = NULL;
+  buf->body_order = 0;
+  buf->body_free = NULL;
+
+  return body;
+}
+
 void iobuf_set_len(struct iobuf *buf, u32 len) {
   buf->len = len;
 }
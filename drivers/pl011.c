@@ -12,6 +12,9 @@
 #include "localnode.h"
 #include "compiler.h"
 #include "gpio.h"
+#include "vsm.h"
+#include "vsm-log.h"
+#include "vsm-lat.h"
 
 static void *uartbase;
 
@@ -65,6 +68,16 @@ static void pl011_intr(__unused void *arg) {
 
       if(c == 'p')
         panic("syspanic");
+      else if(c == 'v')
+        vsm_statdump(16);
+      else if(c == 'V')
+        vsm_statreset();
+      else if(c == 't')
+        vsm_logdump(64);
+      else if(c == 'l')
+        vsm_lat_dump();
+      else if(c == 'L')
+        vsm_lat_reset();
     }
   }
 
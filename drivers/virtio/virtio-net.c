@@ -13,15 +13,19 @@
 #include "irq.h"
 #include "panic.h"
 #include "memlayout.h"
+#include "cache.h"
+#include "objpool.h"
 
 static struct virtio_net vtnet_dev;
 
+static DEFINE_OBJPOOL(tx_hdr_pool, struct virtio_tx_hdr, NQUEUE);
+
 static inline void virtio_net_get_mac(struct virtio_net *dev, u8 *buf) {
   memcpy(buf, dev->cfg->mac, sizeof(u8)*6);
 }
 
 static struct virtio_tx_hdr *virtio_tx_hdr_alloc(void *p) {
-  struct virtio_tx_hdr *hdr = malloc(sizeof(*hdr));
+  struct virtio_tx_hdr *hdr = objpool_alloc(&tx_hdr_pool);
 
   hdr->vh.flags = 0;
   hdr->vh.gso_type = VIRTIO_NET_HDR_GSO_NONE;
@@ -70,7 +74,7 @@ static void txintr(struct virtq *txq) {
   while((hdr = virtq_dequeue(txq, &len)) != NULL) {
     struct iobuf *iobuf = hdr->packet;
 
-    free(hdr);
+    objpool_free(&tx_hdr_pool, hdr);
     free_iobuf(iobuf);
   }
 
@@ -81,11 +85,20 @@ static void fill_recv_queue(struct virtq *rxq) {
   struct virtio_net *dev = rxq->dev->priv;
   struct qlist qs[2];
   u32 hdr_len = sizeof(struct virtio_net_hdr) + ETH_POCV2_MSG_HDR_SIZE;
+  u32 body_len = msg_body_max_mtu(dev->mtu);
 
   while(dev->n_rxbuf < NQUEUE/2) {
     struct iobuf *iobuf = alloc_iobuf(hdr_len);
-    iobuf->body = alloc_page();
-    iobuf->body_len = 4096;
+    if(!iobuf)
+      break;
+
+    if(!iobuf_alloc_body(iobuf, body_len)) {
+      free_iobuf(iobuf);
+      break;
+    }
+
+    /* body may be mapped to guest as is (see msg_recv) */
+    dcache_flush_poc_range(iobuf->body, body_len);
 
     qs[0] = (struct qlist){ iobuf->data, iobuf->len };
     qs[1] = (struct qlist){ iobuf->body, iobuf->body_len };
@@ -94,6 +107,10 @@ static void fill_recv_queue(struct virtq *rxq) {
 
     dev->n_rxbuf++;
   }
+
+  /* out of memory: refill again at next rx interrupt */
+  if(dev->n_rxbuf < NQUEUE/2)
+    vmm_warn("virtio-net: %d rx buffers\n", dev->n_rxbuf);
 }
 
 static void rxintr(struct virtq *rxq) {
@@ -124,7 +141,6 @@ int virtio_net_probe(struct virtio_mmio_dev *dev) {
   dev->priv = &vtnet_dev;
   vtnet_dev.cfg = (struct virtio_net_config *)(dev->base + VIRTIO_MMIO_CONFIG);
 
-  vtnet_dev.mtu = vtnet_dev.cfg->mtu;
   vtnet_dev.n_rxbuf = 0;
 
   /* negotiate */
@@ -136,6 +152,12 @@ int virtio_net_probe(struct virtio_mmio_dev *dev) {
   if(vtmmio_negotiate(dev, features) < 0)
     panic("failed negotiate");
 
+  /* mtu field exists only if VIRTIO_NET_F_MTU was negotiated */
+  if(dev->features & (1ul << VIRTIO_NET_F_MTU))
+    vtnet_dev.mtu = vtnet_dev.cfg->mtu;
+  else
+    vtnet_dev.mtu = 1500;
+
   vtnet_dev.rx = virtq_create(dev, 0, rxintr);
   vtnet_dev.tx = virtq_create(dev, 1, txintr);
 
@@ -0,0 +1,262 @@
+/*
+ *  vsm micro-benchmarks, run by vcpu0 on node 0
+ *
+ *  every benchmark touches its own range of fresh pages, so results do
+ *  not depend on the order of benchmarks.
+ */
+
+#include "vsmtest.h"
+
+#define REMOTE        node_ram(1)
+#define LOCAL_FREE    (node_ram(0) + NODE_RAM / 2)
+
+/* larger than the sequential prefetch window of the hypervisor */
+#define FAULT_STRIDE  (16 * PAGESIZE)
+#define NR_FAULT      256
+
+#define PINGPONG_ROUNDS   1000
+#define STREAM_SIZE       (8 * MiB)
+#define FANOUT_PAGES      64
+
+/* remote test ranges */
+#define R_READ        (REMOTE + 0)
+#define R_WRITE       (REMOTE + 16 * MiB)
+#define R_PINGPONG    (REMOTE + 32 * MiB)
+#define R_SEQ         (REMOTE + 64 * MiB)
+#define R_RAND        (REMOTE + 64 * MiB + STREAM_SIZE)
+
+static u64 sample[NR_FAULT];
+static u64 sink;
+
+static u64 rand_state = 0x2545f4914f6cdd1d;
+
+static u64 xorshift() {
+  u64 x = rand_state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+
+  return rand_state = x;
+}
+
+static void sort(u64 *a, int n) {
+  for(int i = 1; i < n; i++) {
+    u64 v = a[i];
+    int j;
+
+    for(j = i; j > 0 && a[j - 1] > v; j--)
+      a[j] = a[j - 1];
+    a[j] = v;
+  }
+}
+
+static void report(char *name, u64 *t, int n) {
+  u64 sum = 0;
+
+  sort(t, n);
+
+  for(int i = 0; i < n; i++)
+    sum += t[i];
+
+  printf("%s: n %d avg %u min %u p50 %u p99 %u max %u ns\n", name, n,
+         ticks_to_ns(sum / n), ticks_to_ns(t[0]), ticks_to_ns(t[n / 2]),
+         ticks_to_ns(t[n * 99 / 100]), ticks_to_ns(t[n - 1]));
+}
+
+static void read_pages(u64 base, u64 npages, u64 stride) {
+  for(u64 i = 0; i < npages; i++)
+    sink += *(volatile u64 *)(base + i * stride);
+}
+
+static void write_pages(u64 base, u64 npages, u64 stride) {
+  for(u64 i = 0; i < npages; i++)
+    *(volatile u64 *)(base + i * stride) = i;
+}
+
+static void pong(volatile u64 *c, u64 rounds) {
+  for(u64 i = 0; i < rounds; i++) {
+    while(*c != 2 * i + 1)
+      cpu_relax();
+    *c = 2 * i + 2;
+  }
+}
+
+void helper_exec(enum helper_op op, u64 *arg) {
+  switch(op) {
+    case OP_READ:
+      read_pages(arg[0], arg[1], arg[2]);
+      break;
+    case OP_WRITE:
+      write_pages(arg[0], arg[1], arg[2]);
+      break;
+    case OP_PONG:
+      pong((volatile u64 *)arg[0], arg[1]);
+      break;
+    default:
+      break;
+  }
+}
+
+/* remote read fault: node 1 is manager and owner (2 hop) */
+static void bench_read_fault() {
+  for(int i = 0; i < NR_FAULT; i++) {
+    volatile u64 *p = (u64 *)(R_READ + i * FAULT_STRIDE);
+    u64 t0 = now();
+
+    sink += *p;
+
+    sample[i] = now() - t0;
+  }
+
+  report("read fault", sample, NR_FAULT);
+}
+
+static void bench_write_fault() {
+  for(int i = 0; i < NR_FAULT; i++) {
+    volatile u64 *p = (u64 *)(R_WRITE + i * FAULT_STRIDE);
+    u64 t0 = now();
+
+    *p = i;
+
+    sample[i] = now() - t0;
+  }
+
+  report("write fault", sample, NR_FAULT);
+
+  /* pages read in bench_read_fault(): upgrade read copy to ownership */
+  for(int i = 0; i < NR_FAULT; i++) {
+    volatile u64 *p = (u64 *)(R_READ + i * FAULT_STRIDE);
+    u64 t0 = now();
+
+    *p = i;
+
+    sample[i] = now() - t0;
+  }
+
+  report("write upgrade", sample, NR_FAULT);
+}
+
+/* a write ownership moves between node 0 and node 1 twice per round */
+static void bench_pingpong() {
+  volatile u64 *c = (u64 *)R_PINGPONG;
+  int peer = NODE_NCPU;   /* vcpu0 of node 1 */
+  u64 t0, t;
+
+  *c = 0;
+
+  helper_call(peer, OP_PONG, (u64)c, PINGPONG_ROUNDS, 0);
+
+  t0 = now();
+
+  for(u64 i = 0; i < PINGPONG_ROUNDS; i++) {
+    while(*c != 2 * i)
+      cpu_relax();
+    *c = 2 * i + 1;
+  }
+
+  while(*c != 2 * PINGPONG_ROUNDS)
+    cpu_relax();
+
+  t = now() - t0;
+
+  helper_wait(peer);
+
+  printf("ping-pong: %d rounds, round trip %u ns\n", PINGPONG_ROUNDS,
+         ticks_to_ns(t / PINGPONG_ROUNDS));
+}
+
+static u64 sum_page(u64 page) {
+  u64 *p = (u64 *)page;
+  u64 s = 0;
+
+  for(int i = 0; i < PAGESIZE / sizeof(u64); i++)
+    s += p[i];
+
+  return s;
+}
+
+static void report_bw(char *name, u64 bytes, u64 t) {
+  u64 ns = ticks_to_ns(t);
+
+  printf("%s: %u KiB in %u us, %u MiB/s\n", name, bytes / KiB, ns / 1000,
+         bytes * 1000000000 / MiB / ns);
+}
+
+static void bench_stream() {
+  u64 npages = STREAM_SIZE / PAGESIZE;
+  static u32 order[STREAM_SIZE / PAGESIZE];
+  u64 t0, t;
+
+  t0 = now();
+  for(u64 i = 0; i < npages; i++)
+    sink += sum_page(R_SEQ + i * PAGESIZE);
+  t = now() - t0;
+
+  report_bw("sequential read", STREAM_SIZE, t);
+
+  /* random page order */
+  for(u32 i = 0; i < npages; i++)
+    order[i] = i;
+
+  for(u32 i = npages - 1; i > 0; i--) {
+    u32 j = xorshift() % (i + 1);
+    u32 tmp = order[i];
+
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  t0 = now();
+  for(u64 i = 0; i < npages; i++)
+    sink += sum_page(R_RAND + order[i] * PAGESIZE);
+  t = now() - t0;
+
+  report_bw("random read", STREAM_SIZE, t);
+}
+
+/*
+ *  vcpu0 writes pages read by n vcpus of other nodes:
+ *  the write invalidates every node in the copyset
+ */
+static void bench_inv_fanout() {
+  int reader[NCPU], nreader = 0;
+
+  for(int cpu = NODE_NCPU; cpu < NCPU; cpu++)
+    reader[nreader++] = cpu;
+
+  for(int n = 1; n <= nreader; n++) {
+    u64 base = LOCAL_FREE + (n - 1) * FANOUT_PAGES * PAGESIZE;
+    int nnode = 0, last = -1;
+    u64 t0, t;
+
+    write_pages(base, FANOUT_PAGES, PAGESIZE);
+
+    for(int i = 0; i < n; i++)
+      helper_call(reader[i], OP_READ, base, FANOUT_PAGES, PAGESIZE);
+
+    for(int i = 0; i < n; i++) {
+      helper_wait(reader[i]);
+
+      if(node_of(reader[i]) != last) {
+        last = node_of(reader[i]);
+        nnode++;
+      }
+    }
+
+    t0 = now();
+    write_pages(base, FANOUT_PAGES, PAGESIZE);
+    t = now() - t0;
+
+    printf("inv fan-out: %d readers on %d nodes, write %u ns/page\n", n, nnode,
+           ticks_to_ns(t / FANOUT_PAGES));
+  }
+}
+
+void bench_all() {
+  bench_read_fault();
+  bench_write_fault();
+  bench_pingpong();
+  bench_stream();
+  bench_inv_fanout();
+}
@@ -1,39 +1,148 @@
-typedef unsigned long u64;
-typedef long i64;
-typedef unsigned int u32;
-typedef signed int i32;
-typedef unsigned short u16;
-typedef signed short i16;
-typedef unsigned char u8;
-typedef signed char i8;
+/*
+ *  vsm benchmark guest
+ *
+ *  vcpu0 (on node 0) runs the benchmarks in bench.c, the other vcpus
+ *  wait for commands in their mailbox and access memory on its behalf.
+ */
 
-#define NULL ((void *)0)
-
-typedef _Bool bool;
-
-#define true 1
-#define false 0
-
-#define intr_enable() \
-  asm volatile("msr daifclr, #0x2" ::: "memory");
+#include "vsmtest.h"
 
 #define PSCI_SYSTEM_OFF   0x84000008
 #define PSCI_SYSTEM_RESET   0x84000009
 #define PSCI_SYSTEM_CPUON   0xc4000003
 
-__attribute__((aligned(16))) char _stack[4096*2];
+/* +1: stack of vcpu n is _stack[n+1] - 1 */
+__attribute__((aligned(PAGESIZE))) char _stack[PAGESIZE * (NCPU + 1)];
+
+/* command and ack on separate pages: each has a single writer */
+struct mailbox {
+  struct {
+    volatile u64 seq;
+    volatile u64 op;
+    volatile u64 arg[3];
+  } cmd __attribute__((aligned(PAGESIZE)));
+  struct {
+    volatile u64 seq;
+    volatile u64 alive;
+  } ack __attribute__((aligned(PAGESIZE)));
+};
+
+static struct mailbox mbox[NCPU];
 
 void psci_call(u32 fn, u64 cpuid, u64 ep);
+u64 vsm_debug(u64 op, u64 arg);
+void _start(void);
+
+/* stage 1: identity map by 1GB blocks, 0-1G device, 1G-4G normal */
+#define MAIR_DEVICE   0
+#define MAIR_NORMAL   1
+
+#define BLOCK         0x1
+#define ATTR(i)       ((u64)(i) << 2)
+#define INNER_SH      (3ul << 8)
+#define AF            (1ul << 10)
+
+static u64 l1[512] __attribute__((aligned(PAGESIZE)));
+
+static void mmu_init_table() {
+  l1[0] = 0 | ATTR(MAIR_DEVICE) | AF | BLOCK;
+
+  for(u64 i = 1; i < 4; i++)
+    l1[i] = (i << 30) | ATTR(MAIR_NORMAL) | INNER_SH | AF | BLOCK;
+
+  dsb();
+}
+
+static void mmu_enable() {
+  /* T0SZ=32, WBWA, inner shareable, 4KB granule, no TTBR1 walk */
+  u64 tcr = 32 | (1 << 8) | (1 << 10) | (3 << 12) | (1 << 23);
+
+  write_sysreg(mair_el1, 0xfful << (MAIR_NORMAL * 8));
+  write_sysreg(tcr_el1, tcr);
+  write_sysreg(ttbr0_el1, l1);
+  isb();
+
+  asm volatile("tlbi vmalle1");
+  dsb();
+  isb();
+
+  /* M, C, I */
+  write_sysreg(sctlr_el1, read_sysreg(sctlr_el1) | (1 << 0) | (1 << 2) | (1 << 12));
+  isb();
+}
+
+void helper_call(int cpu, enum helper_op op, u64 a0, u64 a1, u64 a2) {
+  struct mailbox *m = &mbox[cpu];
+
+  m->cmd.op = op;
+  m->cmd.arg[0] = a0;
+  m->cmd.arg[1] = a1;
+  m->cmd.arg[2] = a2;
+  dmb();
+  m->cmd.seq++;
+}
+
+void helper_wait(int cpu) {
+  struct mailbox *m = &mbox[cpu];
+
+  while(m->ack.seq != m->cmd.seq)
+    cpu_relax();
+
+  dmb();
+}
+
+void secondary_main(int cpu) {
+  struct mailbox *m = &mbox[cpu];
+  u64 seq = 0, arg[3];
+
+  mmu_enable();
+
+  m->ack.alive = 1;
+
+  for(;;) {
+    while(m->cmd.seq == seq)
+      cpu_relax();
+
+    dmb();
+    seq = m->cmd.seq;
+    arg[0] = m->cmd.arg[0];
+    arg[1] = m->cmd.arg[1];
+    arg[2] = m->cmd.arg[2];
+
+    helper_exec(m->cmd.op, arg);
+
+    dmb();
+    m->ack.seq = seq;
+  }
+}
 
 int main(void) {
-  psci_call(PSCI_SYSTEM_CPUON, 1, 0x40000000);
+  mmu_init_table();
+  mmu_enable();
+
+  printf("vsmtest: %d nodes %d vcpus, cntfrq %u\n", NR_NODE, NCPU, read_sysreg(cntfrq_el0));
+
+  for(int cpu = 1; cpu < NCPU; cpu++) {
+    psci_call(PSCI_SYSTEM_CPUON, cpu, (u64)_start);
+
+    while(!mbox[cpu].ack.alive)
+      cpu_relax();
+  }
+
+  printf("vsmtest: all vcpus online\n");
+
+  /* reset hypervisor side page stats and latency histograms */
+  vsm_debug(1, 0);
+  vsm_debug(4, 0);
+
+  bench_all();
+
+  /* and dump them: the hottest 16 pages, histograms */
+  vsm_debug(0, 16);
+  vsm_debug(3, 0);
 
-  volatile u32 *p = (volatile u32 *)(0x40000000+256*1024);
-  volatile u32 c;
+  printf("vsmtest: done\n");
 
-  for(int i = 0; i < 10; i++)
-    c = p[i];
-  
   for(;;)
     ;
 }
@@ -0,0 +1,86 @@
+#include "vsmtest.h"
+
+#define UARTBASE    0x09000000
+
+#define R(reg)  (volatile u32 *)(UARTBASE+reg)
+
+#define DR  0x00
+#define FR  0x18
+#define FR_TXFF (1<<5)  // transmit fifo full
+
+void uart_putc(char c) {
+  if(c == '\n')
+    uart_putc('\r');
+
+  while(*R(FR) & FR_TXFF)
+    ;
+  *R(DR) = c;
+}
+
+void uart_puts(char *s) {
+  char c;
+  while((c = *s++))
+    uart_putc(c);
+}
+
+static void printnum(u64 num, int base, int width, bool sign) {
+  char buf[sizeof(num) * 8 + 1];
+  char *end = buf + sizeof(buf);
+  char *cur = end - 1;
+  bool neg = false;
+
+  if(sign && (i64)num < 0) {
+    neg = true;
+    num = -(i64)num;
+  }
+
+  *cur = '\0';
+
+  do {
+    *--cur = "0123456789abcdef"[num % base];
+  } while(num /= base);
+
+  if(neg)
+    *--cur = '-';
+
+  for(int n = end - 1 - cur; n < width; n++)
+    uart_putc(' ');
+
+  uart_puts(cur);
+}
+
+/* %d(int) %u %x %p(u64) %s %c, with width for numbers */
+int printf(const char *fmt, ...) {
+  __builtin_va_list ap;
+  char c;
+
+  __builtin_va_start(ap, fmt);
+
+  while((c = *fmt++)) {
+    int width = 0;
+
+    if(c != '%') {
+      uart_putc(c);
+      continue;
+    }
+
+    while(*fmt >= '0' && *fmt <= '9')
+      width = width * 10 + *fmt++ - '0';
+
+    switch((c = *fmt++)) {
+      case 'd': printnum((i64)__builtin_va_arg(ap, int), 10, width, true); break;
+      case 'u': printnum(__builtin_va_arg(ap, u64), 10, width, false); break;
+      case 'x': printnum(__builtin_va_arg(ap, u64), 16, width, false); break;
+      case 'p': uart_puts("0x"); printnum(__builtin_va_arg(ap, u64), 16, width, false); break;
+      case 's': uart_puts(__builtin_va_arg(ap, char *)); break;
+      case 'c': uart_putc(__builtin_va_arg(ap, int)); break;
+      case '%': uart_putc('%'); break;
+      case '\0': fmt--; break;
+      default: uart_putc('%'); uart_putc(c); break;
+    }
+  }
+
+  __builtin_va_end(ap);
+
+  return 0;
+}
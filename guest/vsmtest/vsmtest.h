@@ -0,0 +1,87 @@
+#ifndef VSMTEST_H
+#define VSMTEST_H
+
+typedef unsigned long u64;
+typedef long i64;
+typedef unsigned int u32;
+typedef signed int i32;
+typedef unsigned short u16;
+typedef signed short i16;
+typedef unsigned char u8;
+typedef signed char i8;
+
+#define NULL ((void *)0)
+
+typedef _Bool bool;
+
+#define true 1
+#define false 0
+
+#define PAGESIZE    4096
+#define KiB         (1024ul)
+#define MiB         (1024ul * 1024)
+
+#ifndef NR_NODE
+#define NR_NODE     2
+#endif
+
+/* same as localvm_init() in the hypervisor */
+#define NODE_NCPU   4
+#define NODE_RAM    (512 * MiB)
+#define RAM_START   0x40000000ul
+
+#define NCPU        (NR_NODE * NODE_NCPU)
+
+/* vcpus are numbered in node order */
+#define node_ram(n)     (RAM_START + (u64)(n) * NODE_RAM)
+#define node_of(cpu)    ((cpu) / NODE_NCPU)
+
+#define read_sysreg(reg) ({ \
+  u64 _x;                                     \
+  asm volatile("mrs %0, " #reg : "=r"(_x));   \
+  _x; })
+
+#define write_sysreg(reg, val) ({ \
+  u64 _x = (u64)(val);                          \
+  asm volatile("msr " #reg ", %0" :: "r"(_x));  \
+  })
+
+#define isb()     asm volatile("isb" ::: "memory")
+#define dmb()     asm volatile("dmb ish" ::: "memory")
+#define dsb()     asm volatile("dsb ish" ::: "memory")
+#define cpu_relax()   asm volatile("yield" ::: "memory")
+
+static inline int cpuid() {
+  return read_sysreg(mpidr_el1) & 0xff;
+}
+
+static inline u64 now() {
+  isb();
+  return read_sysreg(cntvct_el0);
+}
+
+static inline u64 ticks_to_ns(u64 t) {
+  return t * 1000 / (read_sysreg(cntfrq_el0) / 1000000);
+}
+
+/* uart.c */
+void uart_putc(char c);
+void uart_puts(char *s);
+int printf(const char *fmt, ...);
+
+/* main.c */
+enum helper_op {
+  OP_NONE,
+  OP_READ,        /* read a word of arg[1] pages from arg[0] by arg[2] bytes stride */
+  OP_WRITE,       /* write ditto */
+  OP_PONG,        /* pong side of ping-pong on arg[0], arg[1] rounds */
+};
+
+void helper_call(int cpu, enum helper_op op, u64 a0, u64 a1, u64 a2);
+void helper_wait(int cpu);
+
+/* bench.c */
+void bench_all(void);
+void helper_exec(enum helper_op op, u64 *arg);
+
+#endif  /* VSMTEST_H */
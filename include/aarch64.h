@@ -103,6 +103,11 @@ static inline bool local_irq_disabled() {
   return (read_sysreg(daif) >> 7) & 0x1;
 }
 
+/* physical irq is pending, even if masked (ISR_EL1 reads it at EL2) */
+static inline bool local_irq_pending() {
+  return (read_sysreg(isr_el1) >> 7) & 0x1;
+}
+
 static inline u64 r_sp() {
   u64 x;
   asm volatile("mov %0, sp" : "=r"(x));
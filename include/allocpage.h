@@ -4,9 +4,18 @@
 void pageallocator_init(void);
 void pagealloc_init_early(void);
 
-void *alloc_pages(int order);
+#include "types.h"
 
-#define alloc_page()  alloc_pages(0)
+#define ALLOC_NOZERO    (1 << 0)    /* caller overwrites whole pages */
+
+void *alloc_pages_flags(int order, int aflags);
+
+#define alloc_pages(order)          alloc_pages_flags(order, 0)
+#define alloc_page()                alloc_pages(0)
+#define alloc_pages_nozero(order)   alloc_pages_flags(order, ALLOC_NOZERO)
+#define alloc_page_nozero()         alloc_pages_nozero(0)
+
+bool page_prezero_idle(void);
 
 void free_pages(void *pages, int order);
 
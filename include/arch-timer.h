@@ -4,11 +4,25 @@
 #include "types.h"
 #include "aarch64.h"
 
+/* PPI of EL2 physical timer (CNTHP) */
+#define HYP_TIMER_IRQ     26
+
 void arch_timer_init_core(void);
 
 void arch_timer_init(void);
 
 void usleep(int us);
+u64 usec_to_cycles(u64 us);
+
+/* users of hyp timer on each cpu; the earliest deadline is programmed */
+enum hyp_timer_slot {
+  HYP_TIMER_MSG,        /* wakeup from msg_wait_reply() */
+  HYP_TIMER_LEASE,      /* read lease of vsm running out */
+  NR_HYP_TIMER,
+};
+
+void hyp_timer_arm(enum hyp_timer_slot slot, u64 deadline);
+void hyp_timer_disarm(enum hyp_timer_slot slot);
 
 static inline u64 now_cycles() {
   return read_sysreg(cntpct_el0);
@@ -12,5 +12,6 @@ struct guest {
 extern struct guest virt_dtb;
 extern struct guest linux_img;
 extern struct guest rootfs_img;
+extern struct guest vsmtest_img;
 
 #endif
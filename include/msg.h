@@ -6,6 +6,7 @@
 #include "ethernet.h"
 #include "spinlock.h"
 #include "compiler.h"
+#include "mm.h"
 
 enum msgtype {
   MSG_NONE            = 0x0,
@@ -27,15 +28,20 @@ enum msgtype {
   MSG_SGI             = 0x10,
   MSG_PANIC           = 0x11,
   MSG_BOOT_SIG        = 0x12,
+  MSG_FETCH_BATCH     = 0x13,
+  MSG_MANAGER         = 0x14,
   NUM_MSG,
 };
 
 /*
- *  pocv2-msg protocol via Ethernet (64 - 4160 byte)
+ *  pocv2-msg protocol via Ethernet (64 - 64+MSG_BODY_MAX byte)
  *  +-------------+---------------------------+------------------+
  *  | etherheader | src | type | conid | argv |      (body)      |
  *  +-------------+---------------------------+------------------+
- *     (14 byte)            (50 byte)           (up to 4096 byte)
+ *     (14 byte)            (50 byte)           (up to msg_body_max())
+ *
+ *  body is a multiple of pages the link mtu can carry:
+ *  at least 1 page, 2 pages with 9000 byte mtu
  */
 
 struct msg_header {
@@ -48,6 +54,22 @@ struct msg_header {
 
 #define ETH_POCV2_MSG_HDR_SIZE    64
 
+#define MSG_BODY_MAX_PAGES        2
+#define MSG_BODY_MAX              (MSG_BODY_MAX_PAGES * PAGESIZE)
+
+/* max body length a frame of @mtu can carry */
+static inline u32 msg_body_max_mtu(int mtu) {
+  int len = mtu - (ETH_POCV2_MSG_HDR_SIZE - sizeof(struct etherheader));
+  u32 body = len > 0 ? (u32)len & ~(PAGESIZE - 1) : 0;
+
+  if(body < PAGESIZE)
+    return PAGESIZE;
+  if(body > MSG_BODY_MAX)
+    return MSG_BODY_MAX;
+
+  return body;
+}
+
 struct msg {
   u16 dst_id;
   struct msg_header *hdr;   /* must be 8 byte alignment */
@@ -55,12 +77,19 @@ struct msg {
   void *body;
   u32 body_len;
 
+  u32 nreply;         /* num of replies to this request (async) */
+
+  /* if set, body is sent without copy and released by body_free on tx completion */
+  void (*body_free)(void *body);
+
   /* private */
   struct msg *next;       /* msg_queue */
   struct iobuf *data;     /* raw data */
 };
 
 #define M_BCAST             (1 << 0)    /* broadcast msg */
+#define M_ASYNC             (1 << 1)    /* don't wait reply, reply_cb is called on arrival
+                                           or with NULL on timeout */
 
 #define msg_cpu(msg)        ((msg)->hdr->connectionid & 0x7)
 #define msg_connid(msg)     ((msg)->hdr->connectionid)
@@ -81,6 +110,25 @@ static inline bool msg_queue_empty(struct msg_queue *q) {
   return q->head == NULL;
 }
 
+/*
+ *  request waiting for its reply
+ *  per-vCPU table, reply is matched by connectionid
+ */
+struct msg_pending {
+  u32 connectionid;
+  bool used;
+  bool async;         /* nobody waits: call reply_cb on arrival */
+  u32 nreply;         /* async: replies not yet arrived */
+  u64 deadline;       /* async: fail if replies have not all arrived by then */
+  struct msg * volatile reply;
+  void (*reply_cb)(struct msg *, void *);
+  void *cb_arg;
+};
+
+#define NR_MSG_PENDING      16
+
+#define MSG_REPLY_TIMEOUT_US    200000
+
 struct msg_size_data {
   enum msgtype type;
   u32 msg_hdr_size;
@@ -133,8 +181,8 @@ struct msg_data {
     .recv_handler = handler,                                    \
   };
 
-void __send_msg(struct msg *msg, void (*reply_cb)(struct msg *, void *),
-                void *cb_arg, int flags);
+int __send_msg(struct msg *msg, void (*reply_cb)(struct msg *, void *),
+               void *cb_arg, int flags);
 
 #define send_msg(msg)         __send_msg((msg), NULL, NULL, 0)
 
@@ -143,16 +191,22 @@ void __send_msg(struct msg *msg, void (*reply_cb)(struct msg *, void *),
 #define send_msg_cb(msg, cb, arg) \
   __send_msg((msg), (cb), (arg), 0)
 
+#define send_msg_async(msg, cb, arg) \
+  __send_msg((msg), (cb), (arg), M_ASYNC)
+
 int msg_recv(u8 *src_mac, struct iobuf *buf);
 
 #define msg_init(msg, dst_id, type, hdr, body, body_len)   \
   __msg_init(msg, dst_id, type, (struct msg_header *)hdr, body, body_len, cpuid())
 
-#define msg_init_reqcpu(msg, dst_id, type, hdr, body, body_len, reqcpu) \
-  __msg_init(msg, dst_id, type, (struct msg_header *)hdr, body, body_len, reqcpu)
+/* continue the connection @connid: forwarded request or reply to it */
+#define msg_init_conn(msg, dst_id, type, hdr, body, body_len, connid) \
+  __msg_init_conn(msg, dst_id, type, (struct msg_header *)hdr, body, body_len, connid)
 
 void __msg_init(struct msg *msg, u16 dst_id, enum msgtype type,
                 struct msg_header *hdr, void *body, int body_len, int reqcpu);
+void __msg_init_conn(struct msg *msg, u16 dst_id, enum msgtype type,
+                     struct msg_header *hdr, void *body, int body_len, u32 connid);
 
 #define msg_reply(msg, type, hdr, body, body_len)   \
   __msg_reply(msg, type, (struct msg_header *)hdr, body, body_len)
@@ -160,11 +214,14 @@ void __msg_init(struct msg *msg, u16 dst_id, enum msgtype type,
 void __msg_reply(struct msg *msg, enum msgtype type,
                  struct msg_header *hdr, void *body, int body_len);
 
+u32 msg_body_max(void);
+
 void msg_sysinit(void);
 
 struct msg *pocv2_recv_reply(struct msg *msg);
 void free_recv_msg(struct msg *msg);
 
 void do_recv_waitqueue(void);
+void msg_async_timeout_check(void);
 
 #endif
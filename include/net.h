@@ -30,10 +30,12 @@ struct iobuf {
 
   struct etherheader *eth;
 
-  /* page */
+  /* pages */
   void *body;
   u32 len;
   u32 body_len;
+  int body_order;
+  void (*body_free)(void *body);    /* body is not owned by iobuf if set */
 
   int npages;
 };
@@ -45,6 +47,8 @@ static inline struct iobuf *alloc_iobuf(u32 size) {
 }
 
 void free_iobuf(struct iobuf *buf);
+void *iobuf_alloc_body(struct iobuf *buf, u32 len);
+void *iobuf_take_body(struct iobuf *buf);
 void *iobuf_push(struct iobuf *buf, u32 size);
 void *iobuf_pull(struct iobuf *buf, u32 size);
 void iobuf_set_len(struct iobuf *buf, u32 len);
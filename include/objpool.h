@@ -0,0 +1,50 @@
+#ifndef OBJPOOL_H
+#define OBJPOOL_H
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "compiler.h"
+
+/*
+ *  fixed-size object pool preallocated at boot
+ *  for objects allocated and freed in irq or fault path
+ */
+
+struct objpool_cpu {
+  void *freelist;
+  u32 nfree;
+};
+
+struct objpool {
+  const char *name;
+  u32 objsize;
+  u32 nobj;
+
+  /* private */
+  void *start;
+  void *end;
+  struct objpool_cpu cpu[NCPU_MAX];
+  void *shared;       /* objects not owned by any cpu */
+  u32 nshared;
+  spinlock_t lock;
+  u64 nfallback;      /* num of malloc() on pool exhaustion */
+};
+
+#define DEFINE_OBJPOOL(_name, type, n)                      \
+  struct objpool _name = {                                  \
+    .name = #_name,                                         \
+    .objsize = sizeof(type),                                \
+    .nobj = (n),                                            \
+    .lock = SPINLOCK_INIT,                                  \
+  };                                                        \
+  static struct objpool *const __objpool_##_name            \
+  __used __section(".rodata.objpool") = &_name
+
+void *objpool_alloc(struct objpool *pool);
+void objpool_free(struct objpool *pool, void *obj);
+
+void objpool_sysinit(void);
+void objpool_dump(void);
+
+#endif
@@ -63,6 +63,11 @@ extern u64 *vttbr;
 #define S2PTE_RW              S2PTE_S2AP(3ul)
 
 #define S2PTE_DBM             (1ul << 51)
+#define S2PTE_CONT            (1ul << 52)
+
+/* contiguous hint: 16 level 3 entries = 64KB */
+#define S2_CONT_PAGES         16
+#define S2_CONT_SIZE          (S2_CONT_PAGES * PAGESIZE)
 
 /* use bit[58:55] to keep page's copyset  */
 #define S2PTE_COPYSET_SHIFT   55
@@ -76,12 +81,24 @@ physaddr_t ipa2pa(ipa_t ipa);
 physaddr_t at_uva2pa(u64 uva);
 ipa_t at_uva2ipa(u64 uva);
 
+u64 *s2_pagewalk(ipa_t ipa, bool create);
+u64 *s2_walk(ipa_t ipa);
+u64 *s2_split_walk(ipa_t ipa);
+u64 *s2_accessible_pte(ipa_t ipa);
 u64 *s2_rwable_pte(ipa_t ipa);
 u64 *s2_readable_pte(ipa_t ipa);
 u64 *s2_ro_pte(ipa_t ipa);
 void s2_page_invalidate(ipa_t ipa);
 void s2_page_ro(ipa_t ipa);
 
+bool s2_cont_check(ipa_t ipa);
+bool s2_cont_make(ipa_t ipa);
+void s2_cont_split(u64 *pte, ipa_t ipa);
+
+void s2_tlb_gather(ipa_t ipa, u64 size);
+void s2_tlb_gather_free(void *page, void (*free)(void *));
+void s2_tlb_flush_gathered(void);
+
 void copy_to_guest(ipa_t to_ipa, char *from, u64 len, bool alloc);
 void copy_from_guest(char *to, ipa_t from_ipa, u64 len);
 
@@ -135,11 +152,23 @@ static inline int faulting_addr(u64 esr, u64 *far, u64 *fipa_page) {
 }
 
 static inline bool s2_accessible(ipa_t ipa) {
-  return __page_accessible(vttbr, ipa, s2_root_level);
+  return !!s2_accessible_pte(ipa);
+}
+
+static inline bool s2pte_is_accessible(u64 *pte) {
+  return !!(*pte & PTE_AF);
+}
+
+static inline bool s2pte_is_rwable(u64 *pte) {
+  return (*pte & (PTE_AF | S2PTE_S2AP_MASK)) == (PTE_AF | S2PTE_RW);
+}
+
+static inline bool s2pte_is_readable(u64 *pte) {
+  return (*pte & PTE_AF) && (*pte & S2PTE_RO);
 }
 
-static inline u64 *s2_accessible_pte(ipa_t ipa) {
-  return __page_accessible_pte(vttbr, ipa, s2_root_level);
+static inline bool s2pte_is_ro(u64 *pte) {
+  return (*pte & (PTE_AF | S2PTE_S2AP_MASK)) == (PTE_AF | S2PTE_RO);
 }
 
 static inline int s2pte_perm(u64 *pte) {
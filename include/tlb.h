@@ -4,6 +4,7 @@
 #include "aarch64.h"
 #include "mm.h"
 #include "compiler.h"
+#include "types.h"
 
 static inline void tlb_vmm_flush_all() {
   dsb(ishst);
@@ -12,30 +13,104 @@ static inline void tlb_vmm_flush_all() {
   isb();
 }
 
+/* ARMv8.4-TLBIRANGE, set by s2mmu_init() */
+extern bool tlbi_range_supported;
+
 static inline void tlb_s2_flush_all() {
   dsb(ishst);
-  asm volatile("tlbi  vmalls12e1" ::: "memory");
+  asm volatile("tlbi  vmalls12e1is" ::: "memory");
   dsb(ish);
   isb();
 }
 
-#ifdef BUILD_QEMU
+/* per-page tlbi up to this, then flush whole vmid */
+#define TLBI_RANGE_MAX_PAGES    32
 
-/* QEMU does not emulate tlbi ipas2e1 ;; */
+/* can [ipa, ipa + size) be invalidated by __tlbi_s2_range() */
+static inline bool tlb_s2_range_ok(u64 size) {
+  u64 pages = size >> PAGESHIFT;
 
-static inline void tlb_s2_flush_ipa(u64 __unused ipa) {
-  tlb_s2_flush_all();
+  /*
+   *  __tlbi_s2_range() takes bit 0 of pages by a single op and bits
+   *  [5 * scale + 1, 5 * scale + 5] by a range op of scale 0-3:
+   *  32 << 16 itself would need scale 4
+   */
+  if(tlbi_range_supported)
+    return pages < (32ul << 16);
+  else
+    return pages <= TLBI_RANGE_MAX_PAGES;
 }
 
-#else   /* !BUILD_QEMU */
+/* tlbi ripas2e1is (op1=4, CRn=8, CRm=0, op2=2): operand is TG|SCALE|NUM|TTL|BaseADDR */
+static inline void __tlbi_ripas2e1is(u64 ipa, int scale, int num) {
+  u64 arg = (1ul << 46) |                 /* TG: 4KB */
+            ((u64)scale << 44) |
+            ((u64)num << 39) |
+            ((ipa >> PAGESHIFT) & ((1ul << 37) - 1));
 
-static inline void tlb_s2_flush_ipa(u64 ipa) {
-  dsb(ishst);
-  asm volatile("tlbi  ipas2e1, %0" :: "r"(ipa >> PAGESHIFT) : "memory");
+  asm volatile("sys #4, c8, c0, #2, %0" :: "r"(arg) : "memory");
+}
+
+/*
+ *  issue tlbi for stage 2 of [ipa, ipa + size) without barriers
+ *  a range op covers (num + 1) << (5 * scale + 1) pages
+ */
+static inline void __tlbi_s2_range(u64 ipa, u64 size) {
+  u64 pages = size >> PAGESHIFT;
+  int scale = 0, num;
+
+  while(pages > 0) {
+    if(!tlbi_range_supported || (pages & 1)) {
+      asm volatile("tlbi  ipas2e1is, %0" :: "r"(ipa >> PAGESHIFT) : "memory");
+      ipa += PAGESIZE;
+      pages--;
+      continue;
+    }
+
+    num = (int)((pages >> (5 * scale + 1)) & 0x1f) - 1;
+    if(num >= 0) {
+      __tlbi_ripas2e1is(ipa, scale, num);
+      ipa += (u64)(num + 1) << (5 * scale + 1 + PAGESHIFT);
+      pages -= (u64)(num + 1) << (5 * scale + 1);
+    }
+
+    scale++;
+  }
+}
+
+/*
+ *  complete __tlbi_s2_range()s: stage 1 entries combined with
+ *  the old stage 2 translation are dropped too.
+ *  QEMU caches only combined entries, so it relies on this vmalle1is
+ */
+static inline void tlb_s2_sync() {
+  dsb(ish);
+  asm volatile("tlbi  vmalle1is" ::: "memory");
   dsb(ish);
   isb();
 }
 
-#endif  /* BUILD_QEMU */
+/* stage 2 entries of @ipa and combined stage 1+2 entries in all cpus */
+static inline void tlb_s2_flush_ipa(u64 ipa) {
+  dsb(ishst);
+  asm volatile("tlbi  ipas2e1is, %0" :: "r"(ipa >> PAGESHIFT) : "memory");
+  tlb_s2_sync();
+}
+
+/*
+ *  invalidate stage 2 of [ipa, ipa + size) now: for break-before-make,
+ *  where old combined entries must be gone before the make.
+ *  other changes are gathered and synced once by s2_tlb_flush_gathered()
+ */
+static inline void tlb_s2_flush_range(u64 ipa, u64 size) {
+  if(!tlb_s2_range_ok(size)) {
+    tlb_s2_flush_all();
+    return;
+  }
+
+  dsb(ishst);
+  __tlbi_s2_range(ipa, size);
+  tlb_s2_sync();
+}
 
 #endif  /* CORE_TLB_H */
@@ -7,6 +7,7 @@
 #include "gic.h"
 #include "aarch64.h"
 #include "mm.h"
+#include "msg.h"
 
 struct pcpu;
 
@@ -22,8 +23,6 @@ struct pending_queue {
   spinlock_t lock;
 };
 
-struct msg;
-
 struct vcpu {
   /* !!! MUST be first field !!! */
   struct {
@@ -41,8 +40,9 @@ struct vcpu {
 
   struct cpu_features features;
 
-  /* msg reply manager */
-  struct msg * volatile reply_buf;
+  /* outstanding requests waiting for reply */
+  struct msg_pending outstanding[NR_MSG_PENDING];
+  u32 nasync;         /* async ones among them */
 
   u64 sctlr_el1;
 
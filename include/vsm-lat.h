@@ -0,0 +1,26 @@
+#ifndef VSM_LAT_H
+#define VSM_LAT_H
+
+#include "types.h"
+
+enum vsm_lat {
+  LAT_READ_LOCAL,       /* another cpu mapped it already */
+  LAT_READ_2HOP,        /* manager is owner, or manager asked owner */
+  LAT_READ_3HOP,        /* forwarded by manager to owner, or to next manager */
+  LAT_WRITE_LOCAL,      /* incl. owner's ro -> rw upgrade */
+  LAT_WRITE_2HOP,
+  LAT_WRITE_3HOP,
+  LAT_INV_FANOUT,       /* vsm_invalidate() */
+  LAT_READ_SERVER,
+  LAT_WRITE_SERVER,
+  LAT_INV_SERVER,
+  LAT_LEASE_SERVER,     /* lease ran out */
+  LAT_MANAGER_SERVER,   /* managership moved to me */
+  NR_VSM_LAT,
+};
+
+void vsm_lat_record(enum vsm_lat kind, u64 cycles);
+void vsm_lat_dump(void);
+void vsm_lat_reset(void);
+
+#endif  /* VSM_LAT_H */
@@ -3,7 +3,8 @@
 
 #include "types.h"
 
-#define VLOG_LEVEL  2
+/* 0: no trace, 1: trace to per-cpu ring */
+#define VLOG_LEVEL  1
 
 enum {
   READ_SENDER,
@@ -12,35 +13,36 @@ enum {
   WRITE_RECEIVER,
   INV_SENDER,
   INV_RECEIVER,
+  READ_DONE,      /* read fault resolved, with latency */
+  WRITE_DONE,     /* write fault resolved, with latency */
   VSM_INFO,
+  NR_VSM_TRACE,
 };
 
+/* fixed-size binary record: 32 byte */
 struct vsmlog {
-  int type;     // read or write or invalidate
-  int cpu;
+  u64 time;       /* cntpct */
   u64 ipa;
-  const char *msg;
-  int from_node;
-  int to_node;
-  u64 daif;
+  u32 connid;
+  u32 latency;    /* in cycles, 0 if none */
+  u8 type;
+  u8 cpu;
+  u8 src;
+  u8 dst;
+  u32 __pad;
 };
 
 void vsm_logdump(int n);
-void vsm_logging(int type, int from_node, int to_node, u64 ipa, const char *msg);
-void vsm_log_out(int type, int from_node, int to_node, u64 ipa, const char *msg);
+void vsm_logging(int type, int src, int dst, u64 ipa, u32 connid, u32 latency);
 
 #if VLOG_LEVEL == 0
 
 #define vsm_log(...)  ((void)0)
 
-#elif VLOG_LEVEL == 1
+#else
 
 #define vsm_log       vsm_logging
 
-#elif VLOG_LEVEL == 2
-
-#define vsm_log       vsm_log_out
-
 #endif  /* VLOG_LEVEL */
 
 #endif  /* VSM_LOG_H */
@@ -12,12 +12,18 @@ struct vcpu;
 #define CONFIG_PAGE_CACHE
 
 /*
- *  manager page
+ *  manager page: directory entry of a page, kept by its current manager
  */
 struct manager_page {
   u8 owner;
+  /* statistics */
+  u8 last_req;        /* node requested last */
+  u16 nowner;         /* ownership changes */
 };
 
+#define VSM_NO_REQ      0xff
+#define VSM_NO_NODE     0xff
+
 struct vsm_waitqueue {
   struct vsm_server_proc *head;
   struct vsm_server_proc *tail;
@@ -33,6 +39,18 @@ struct page_desc {
       u8 wqlock;
     };
   };
+  /* statistics (saturated) */
+  u16 nrfetch;        /* read faults fetched from remote */
+  u16 nwfetch;        /* write faults fetched from remote */
+  u16 ninv;           /* invalidated by remote writer */
+  /* directory (see vsm.c) */
+  u8 manager;         /* me: I am manager; others: probable manager */
+  u8 nfwd;            /* manager: requests forwarded to the same owner */
+  struct manager_page man;    /* valid while I am manager */
+  u8 lwait;          /* owner: writer waits for leases to run out, grant no more */
+  /* read lease, in lease clock (see vsm.c) */
+  u32 lease;          /* owner: leases granted until; others: my lease expires at */
+  u32 rosince;        /* owner: read only since */
 };
 
 struct vsm_server_proc {
@@ -41,17 +59,25 @@ struct vsm_server_proc {
   u64 copyset;        // for invalidate server
   int req_nodeid;
   int type;
-  int req_cpu;
+  int flags;          // fetch flags
+  u32 req_connid;     // connection of original request
+  u32 lease;          // for lease server: expiry of the lease
+  int manager;        // manager forwarded request to me, or VSM_NO_NODE
   void (*do_process)(struct vsm_server_proc *);
 };
 
-#define NR_MANAGER_PAGES        (MEM_PER_NODE >> PAGESHIFT)
-
 int vsm_access(struct vcpu *vcpu, char *buf, u64 ipa, u64 size, bool wr);
 void *vsm_read_fetch_page(u64 page_ipa);
 void *vsm_write_fetch_page(u64 page_ipa);
 void *vsm_read_fetch_instr(u64 page_ipa);
 
+int vsm_set_block_fetch(u64 start, u64 size, int shift);
+int vsm_set_lease(u32 idle_us, u32 lease_us);
+void vsm_lease_expire(void);
+
+void vsm_statdump(int n);
+void vsm_statreset(void);
+
 void vsm_init(void);
 void vsm_node_init(struct memrange *mem);
 
@@ -19,6 +19,19 @@
 #define MiB   (1024 * 1024)
 #define GiB   (1024 * 1024 * 1024)
 
+#ifdef VSMTEST
+
+/* bare-metal benchmark guest: no fdt, no initrd */
+static struct vm_desc vm_desc = {
+  .os_img = &vsmtest_img,
+  .nvcpu = 2,
+  .nallocate = 512 * MiB,
+  .ram_start = 0x40000000,
+  .entrypoint = 0x40000000,
+};
+
+#else
+
 static struct vm_desc vm_desc = {
   .os_img = &linux_img,
   .fdt_img = &virt_dtb,
@@ -33,6 +46,8 @@ static struct vm_desc vm_desc = {
   .initrd_base = 0x48000000,
 };
 
+#endif  /* VSMTEST */
+
 static void initvm(struct vm_desc *desc) {
   struct guest *os = desc->os_img;
   struct guest *fdt = desc->fdt_img;
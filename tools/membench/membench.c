@@ -0,0 +1,155 @@
+/*
+ *  compare core/string.c with byte loop implementation
+ *  (core/lib.c before string.c) on host
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void *vmm_memcpy(void *dst, const void *src, unsigned long n);
+void *vmm_memmove(void *dst, const void *src, unsigned long n);
+void *vmm_memset(void *dst, int c, unsigned long n);
+
+static void *byte_memmove(void *dst, const void *src, unsigned long n) {
+  volatile char *d = dst;
+  const char *s = src;
+
+  if(s > d) {
+    while(n-- > 0)
+      *d++ = *s++;
+  } else {
+    d += n;
+    s += n;
+    while(n-- > 0)
+      *--d = *--s;
+  }
+
+  return dst;
+}
+
+static void *byte_memcpy(void *dst, const void *src, unsigned long n) {
+  return byte_memmove(dst, src, n);
+}
+
+static void *byte_memset(void *dst, int c, unsigned long n) {
+  volatile char *d = dst;
+
+  while(n-- > 0)
+    *d++ = c;
+
+  return dst;
+}
+
+#define BUFSZ   (64 * 1024)
+
+static unsigned char *src, *dst, *ref;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int check(void) {
+  int fail = 0;
+
+  for(int i = 0; i < 20000; i++) {
+    unsigned long n = rand() % 9000;
+    unsigned long so = rand() % 64, doff = rand() % 64;
+    int c = rand() & 0xff;
+
+    for(int j = 0; j < BUFSZ; j++)
+      src[j] = rand();
+
+    memcpy(dst, src, BUFSZ);
+    memcpy(ref, src, BUFSZ);
+
+    switch(i % 4) {
+      case 0:
+        vmm_memcpy(dst + doff, src + so, n);
+        memcpy(ref + doff, src + so, n);
+        break;
+      case 1:
+        vmm_memset(dst + doff, c, n);
+        memset(ref + doff, c, n);
+        break;
+      case 2:
+        vmm_memset(dst + doff, 0, n);
+        memset(ref + doff, 0, n);
+        break;
+      case 3:
+        /* overlap */
+        vmm_memmove(dst + doff, dst + so, n);
+        memmove(ref + doff, ref + so, n);
+        break;
+    }
+
+    if(memcmp(dst, ref, BUFSZ)) {
+      printf("FAIL: case %d n %lu src+%lu dst+%lu\n", i % 4, n, so, doff);
+      fail++;
+    }
+  }
+
+  return fail;
+}
+
+struct bench {
+  const char *name;
+  void *(*fn)(void *, const void *, unsigned long);
+  void *(*setfn)(void *, int, unsigned long);
+};
+
+static double run(struct bench *b, unsigned long n, unsigned long off) {
+  long iter = (256L << 20) / (n > 64 ? n : 64);
+  double t = now();
+
+  for(long i = 0; i < iter; i++) {
+    if(b->fn)
+      b->fn(dst + off, src + off, n);
+    else
+      b->setfn(dst + off, 0, n);
+    asm volatile("" ::: "memory");
+  }
+
+  t = now() - t;
+
+  return (double)n * iter / t / (1 << 20);
+}
+
+int main(void) {
+  static const unsigned long sizes[] = { 64, 512, 4096, 8192 };
+  struct bench benches[] = {
+    { "memcpy(byte)", byte_memcpy, NULL },
+    { "memcpy",       vmm_memcpy, NULL },
+    { "memset(byte)", NULL, byte_memset },
+    { "memset",       NULL, vmm_memset },
+  };
+
+  src = aligned_alloc(4096, BUFSZ);
+  dst = aligned_alloc(4096, BUFSZ);
+  ref = aligned_alloc(4096, BUFSZ);
+
+  if(check()) {
+    printf("membench: wrong result\n");
+    return 1;
+  }
+  printf("membench: check ok\n");
+
+  printf("%-14s", "MiB/s");
+  for(int i = 0; i < 4; i++)
+    printf("%10lu", sizes[i]);
+  printf("%10s\n", "4096+3");
+
+  for(int b = 0; b < 4; b++) {
+    printf("%-14s", benches[b].name);
+    for(int i = 0; i < 4; i++)
+      printf("%10.0f", run(&benches[b], sizes[i], 0));
+    printf("%10.0f\n", run(&benches[b], 4096, 3));
+  }
+
+  return 0;
+}
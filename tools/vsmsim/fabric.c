@@ -0,0 +1,509 @@
+/*
+ *  in-memory message fabric: core/msg.c API between simulated nodes
+ *
+ *  a message is a queued copy of header (and body) on the receiving cpu,
+ *  handled when that cpu polls it like the rx irq tail (do_recv_waitqueue).
+ *  requests go to cpu 0 of destination (cpu picked by source node with -s,
+ *  which keeps messages of a link in order like rx queue steering),
+ *  replies to the requesting cpu of the connection.
+ *  a message can be taken only after the wire latency passed.
+ */
+
+#include "types.h"
+#include "aarch64.h"
+#include "arch-timer.h"
+#include "msg.h"
+#include "mm.h"
+#include "s2mm.h"
+#include "allocpage.h"
+#include "malloc.h"
+#include "lib.h"
+#include "log.h"
+#include "panic.h"
+#include "sim.h"
+
+/* simulated cpus are much slower than real ones */
+#define SIM_REPLY_TIMEOUT_US    10000000
+
+/* async requests fail instead: late replies are dropped as stale */
+#define SIM_ASYNC_TIMEOUT_US    20000
+
+/* zero copy body whose tx completion is not handled yet (-t) */
+struct sim_txdone {
+  struct sim_txdone *next;
+  void *body;
+  void (*body_free)(void *);
+};
+
+/* header and message on the wire */
+struct sim_wire {
+  struct msg msg;
+  u64 arrive;
+  u8 hdr[ETH_POCV2_MSG_HDR_SIZE] __aligned(8);
+};
+
+static u64 inflight;
+
+static u64 nmsg[NUM_MSG];
+static u64 nbytes;
+static u64 ndropped, ntimedout, nstale;
+static u64 ntxlate;
+
+static const char *msg_name[NUM_MSG] = {
+  [MSG_FETCH]           "fetch",
+  [MSG_FETCH_REPLY]     "fetch_reply",
+  [MSG_FETCH_BATCH]     "fetch_batch",
+  [MSG_INVALIDATE]      "invalidate",
+  [MSG_MANAGER]         "manager",
+};
+
+void sim_msg_register(int node, enum msgtype type, u32 hdr_size,
+                      void (*handler)(struct msg *)) {
+  struct msg_data *d = &simnode[node].msg_data[type];
+
+  d->type = type;
+  d->msg_hdr_size = hdr_size;
+  d->recv_handler = handler;
+}
+
+void msg_queue_init(struct msg_queue *q) {
+  q->head = NULL;
+  q->tail = NULL;
+  spinlock_init(&q->lock);
+}
+
+static void msg_enqueue(struct msg_queue *q, struct msg *msg) {
+  u64 flags;
+
+  msg->next = NULL;
+
+  spin_lock_irqsave(&q->lock, flags);
+
+  if(q->head == NULL)
+    q->head = msg;
+
+  if(q->tail)
+    q->tail->next = msg;
+
+  q->tail = msg;
+
+  spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static inline u64 msg_arrival(struct msg *msg) {
+  return container_of(msg, struct sim_wire, msg)->arrive;
+}
+
+static inline bool msg_queue_ready(struct msg_queue *q) {
+  struct msg *m = q->head;
+
+  return m && msg_arrival(m) <= now_cycles();
+}
+
+static void msg_free(struct msg *msg) {
+  /* body is taken over by receiver as in msg_recv() */
+  free(container_of(msg, struct sim_wire, msg));
+
+  __atomic_fetch_sub(&inflight, 1, __ATOMIC_SEQ_CST);
+}
+
+static struct msg_pending *msg_pending_alloc(u32 connectionid, bool async, u32 nreply,
+                                             void (*reply_cb)(struct msg *, void *),
+                                             void *cb_arg) {
+  struct simcpu *c = mysimcpu();
+  struct msg_pending *p;
+
+  for(p = c->outstanding; p < &c->outstanding[NR_MSG_PENDING]; p++) {
+    if(!p->used) {
+      p->used = true;
+      p->async = async;
+      p->nreply = nreply;
+      p->connectionid = connectionid;
+      p->reply = NULL;
+      p->reply_cb = reply_cb;
+      p->cb_arg = cb_arg;
+      p->deadline = async ? now_cycles() + usec_to_cycles(SIM_ASYNC_TIMEOUT_US) : 0;
+
+      if(async)
+        c->nasync++;
+
+      return p;
+    }
+  }
+
+  if(async)
+    return NULL;
+
+  panic("too many outstanding requests");
+}
+
+static void msg_pending_free(struct msg_pending *p) {
+  if(p->async)
+    mysimcpu()->nasync--;
+
+  p->reply = NULL;
+  p->used = false;
+}
+
+static struct msg_pending *msg_pending_lookup(u32 connectionid) {
+  struct simcpu *c = mysimcpu();
+  struct msg_pending *p;
+
+  for(p = c->outstanding; p < &c->outstanding[NR_MSG_PENDING]; p++) {
+    if(p->used && p->connectionid == connectionid)
+      return p;
+  }
+
+  return NULL;
+}
+
+static void recv_reply(struct msg *reply) {
+  struct msg_pending *p = msg_pending_lookup(msg_connid(reply));
+
+  if(!p) {
+    /* async request timed out */
+    __atomic_fetch_add(&nstale, 1, __ATOMIC_RELAXED);
+    msg_free(reply);
+    return;
+  }
+
+  if(p->reply)
+    panic("reply twice %p", msg_connid(reply));
+
+  if(p->async) {
+    /* lost on the wire (-d) */
+    if(sim_rand() % 100 < simcfg.drop) {
+      __atomic_fetch_add(&ndropped, 1, __ATOMIC_RELAXED);
+      msg_free(reply);
+      return;
+    }
+
+    p->reply_cb(reply, p->cb_arg);
+
+    msg_free(reply);
+
+    if(--p->nreply == 0)
+      msg_pending_free(p);
+    return;
+  }
+
+  p->reply = reply;
+}
+
+/* irq disabled, in lazyirq */
+static void recv_waitqueue() {
+  struct msg_queue *recvq = &mysimcpu()->recvq;
+  struct msg *m, *m_next, *head, *last;
+  void (*handler)(struct msg *);
+  u64 now;
+
+restart:
+  now = now_cycles();
+
+  spin_lock(&recvq->lock);
+
+  /* take arrived messages: same latency for all keeps queue order */
+  head = recvq->head;
+  last = NULL;
+
+  for(m = head; m && msg_arrival(m) <= now; m = m->next)
+    last = m;
+
+  if(last) {
+    recvq->head = last->next;
+    if(!recvq->head)
+      recvq->tail = NULL;
+    last->next = NULL;
+  } else {
+    head = NULL;
+  }
+
+  spin_unlock(&recvq->lock);
+
+  local_irq_enable();
+
+  for(m = head; m; m = m_next) {
+    m_next = m->next;
+
+    handler = mysimnode()->msg_data[m->hdr->type].recv_handler;
+
+    if(handler) {
+      handler(m);
+
+      msg_free(m);
+    } else {
+      recv_reply(m);
+    }
+  }
+
+  local_irq_disable();
+
+  if(msg_queue_ready(recvq))
+    goto restart;
+
+  /* stage 2 updates by handlers above */
+  s2_tlb_flush_gathered();
+}
+
+/* msg_async_timeout_check(): irq disabled, in lazyirq */
+static void async_timeout_check() {
+  struct simcpu *c = mysimcpu();
+  struct msg_pending *p;
+  void (*reply_cb)(struct msg *, void *);
+  void *cb_arg;
+  u64 now = now_cycles();
+
+  for(p = c->outstanding; p < &c->outstanding[NR_MSG_PENDING]; p++) {
+    if(!p->used || !p->async || now < p->deadline)
+      continue;
+
+    __atomic_fetch_add(&ntimedout, 1, __ATOMIC_RELAXED);
+
+    reply_cb = p->reply_cb;
+    cb_arg = p->cb_arg;
+    msg_pending_free(p);
+
+    local_irq_enable();
+    reply_cb(NULL, cb_arg);
+    local_irq_disable();
+  }
+}
+
+/* txintr: complete zero copy bodies sent by this cpu */
+static void tx_complete() {
+  struct simcpu *c = mysimcpu();
+  struct sim_txdone *t, *t_next;
+
+  t = c->txdone;
+  c->txdone = NULL;
+
+  for(; t; t = t_next) {
+    t_next = t->next;
+
+    t->body_free(t->body);
+    free(t);
+
+    __atomic_fetch_add(&ntxlate, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* tail of irq_entry(): do_recv_waitqueue(), async timeout and vsm_lease_expire() */
+void sim_irq_poll() {
+  struct simcpu *c = mysimcpu();
+
+  if(!local_irq_enabled() || c->in_lazyirq)
+    return;
+
+  local_irq_disable();
+  c->in_lazyirq = true;
+
+  if(c->txdone)
+    tx_complete();
+
+  if(msg_queue_ready(&c->recvq))
+    recv_waitqueue();
+
+  if(c->nasync)
+    async_timeout_check();
+
+  mysimnode()->ops->lease_expire();
+
+  c->in_lazyirq = false;
+  local_irq_enable();
+}
+
+static struct msg *msg_wait_reply(struct msg_pending *p) {
+  struct msg *reply;
+  u64 flags;
+  u64 deadline = now_cycles() + usec_to_cycles(SIM_REPLY_TIMEOUT_US);
+
+  if(mysimcpu()->in_lazyirq)
+    panic("wait reply in lazyirq: never delivered");
+
+  irqsave(flags);
+
+  while((reply = p->reply) == NULL) {
+    if(now_cycles() >= deadline)
+      panic("deadlock? no reply to %p", p->connectionid);
+
+    /* handle pending irq here */
+    local_irq_enable();
+    sim_irq_poll();
+    local_irq_disable();
+
+    if(!p->reply)
+      sim_relax();
+  }
+
+  msg_pending_free(p);
+
+  irqrestore(flags);
+
+  return reply;
+}
+
+static inline bool msg_type_is_reply(struct simnode *node, struct msg *msg) {
+  return node->msg_data[msg->hdr->type].recv_handler == NULL;
+}
+
+static void msg_deliver(struct msg *msg) {
+  struct simnode *src = mysimnode(), *dst;
+  struct sim_wire *w;
+  struct msg *m;
+  u32 hdrsize;
+  int cpu;
+
+  if(msg->dst_id >= simcfg.nnode)
+    panic("msg to Node %d", msg->dst_id);
+
+  dst = &simnode[msg->dst_id];
+  hdrsize = src->msg_data[msg->hdr->type].msg_hdr_size;
+  if(hdrsize == 0 || hdrsize > ETH_POCV2_MSG_HDR_SIZE)
+    panic("msg type %d not registered", msg->hdr->type);
+
+  w = malloc(sizeof(*w));
+  m = &w->msg;
+
+  memcpy(w->hdr, msg->hdr, hdrsize);
+  m->hdr = (struct msg_header *)w->hdr;
+  m->dst_id = msg->dst_id;
+  m->body = NULL;
+  m->body_len = msg->body_len;
+  m->body_free = NULL;
+  m->data = NULL;
+
+  if(msg->body) {
+    if(msg->body_len > MSG_BODY_MAX)
+      panic("msg: body too big %d", msg->body_len);
+
+    m->body = alloc_pages_nozero(msg->body_len > PAGESIZE ? 1 : 0);
+    memcpy(m->body, msg->body, msg->body_len);
+
+    /* tx completion of zero copy body: at next txintr of this cpu with -t */
+    if(msg->body_free && simcfg.txlate) {
+      struct simcpu *c = mysimcpu();
+      struct sim_txdone *t = malloc(sizeof(*t));
+
+      t->body = msg->body;
+      t->body_free = msg->body_free;
+      t->next = c->txdone;
+      c->txdone = t;
+    } else if(msg->body_free) {
+      msg->body_free(msg->body);
+    }
+  }
+
+  __atomic_fetch_add(&nmsg[msg->hdr->type], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&nbytes, ETH_POCV2_MSG_HDR_SIZE + (msg->body ? msg->body_len : 0),
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&inflight, 1, __ATOMIC_SEQ_CST);
+
+  w->arrive = now_cycles() + usec_to_cycles(simcfg.latency);
+
+  if(msg_type_is_reply(dst, m))
+    cpu = msg_cpu(m);
+  else if(simcfg.spread)
+    cpu = msg->hdr->src_id % simcfg.ncpu;
+  else
+    cpu = 0;
+
+  msg_enqueue(&dst->cpu[cpu].recvq, m);
+}
+
+static u32 new_connection(int reqcpu) {
+  u32 c = __atomic_fetch_add(&mysimnode()->conid, 1, __ATOMIC_RELAXED);
+
+  return c << 3 | (reqcpu & 0x7);
+}
+
+static inline void __msginitcore(struct msg *msg, u16 dst_id, enum msgtype type,
+                                 struct msg_header *hdr, void *body, int body_len,
+                                 int cid) {
+  hdr->src_id = sim_nodeid();
+  hdr->type = type;
+  hdr->connectionid = cid;
+
+  msg->hdr = hdr;
+  msg->dst_id = dst_id;
+  msg->body = body;
+  msg->body_len = body_len;
+  msg->nreply = 1;
+  msg->body_free = NULL;
+}
+
+void __msg_init(struct msg *msg, u16 dst_id, enum msgtype type,
+                struct msg_header *hdr, void *body, int body_len, int reqcpu) {
+  __msginitcore(msg, dst_id, type, hdr, body, body_len, new_connection(reqcpu));
+}
+
+void __msg_init_conn(struct msg *msg, u16 dst_id, enum msgtype type,
+                     struct msg_header *hdr, void *body, int body_len, u32 connid) {
+  __msginitcore(msg, dst_id, type, hdr, body, body_len, connid);
+}
+
+int __send_msg(struct msg *msg, void (*reply_cb)(struct msg *, void *),
+               void *cb_arg, int flags) {
+  struct msg_pending *pending = NULL;
+  bool async = !!(flags & M_ASYNC);
+
+  if(flags & M_BCAST)
+    panic("vsmsim: no broadcast");
+
+  /* register before sending: reply may come back before msg_deliver() returns */
+  if(reply_cb) {
+    if(!async && msg->nreply != 1)
+      panic("multiple replies need M_ASYNC");
+
+    pending = msg_pending_alloc(msg_connid(msg), async, msg->nreply, reply_cb, cb_arg);
+    if(!pending)
+      return -1;
+  }
+
+  msg_deliver(msg);
+
+  if(reply_cb && !async) {
+    struct msg *reply = msg_wait_reply(pending);
+
+    reply_cb(reply, cb_arg);
+
+    msg_free(reply);
+  }
+
+  return 0;
+}
+
+/* messages queued or being handled */
+u64 sim_inflight() {
+  return __atomic_load_n(&inflight, __ATOMIC_SEQ_CST);
+}
+
+/* print messages by type, return total */
+u64 sim_fabric_stat() {
+  u64 total = 0;
+
+  for(int i = 0; i < NUM_MSG; i++) {
+    if(!nmsg[i])
+      continue;
+
+    printf("  %-12s %10lu\n", msg_name[i] ? msg_name[i] : "?", nmsg[i]);
+    total += nmsg[i];
+  }
+
+  printf("  %-12s %10lu (%lu KiB)\n", "total", total, nbytes / 1024);
+
+  if(ntxlate)
+    printf("  zero copy tx completed late %lu\n", ntxlate);
+
+  if(ndropped || ntimedout)
+    printf("  async replies dropped %lu, requests timed out %lu, stale replies %lu\n",
+           ndropped, ntimedout, nstale);
+
+  return total;
+}
+
+void sim_fabric_init() {
+  for(int n = 0; n < simcfg.nnode; n++) {
+    for(int c = 0; c < simcfg.ncpu; c++)
+      msg_queue_init(&simnode[n].cpu[c].recvq);
+  }
+}
@@ -0,0 +1,375 @@
+/*
+ *  host side of vsmsim: threads as vcpus, time, page allocator, panic
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+
+#include "simhost.h"
+
+#define PAGESIZE        4096
+#define ALLOC_NOZERO    (1 << 0)
+
+#define ARENA_SIZE      (16ul << 30)
+#define MAX_ORDER       10
+
+/* freed pages are poisoned and kept a while to catch use after free */
+#define QUARANTINE      1024
+#define POISON          0x5a
+
+/* no guest access completes for this long: dump vcpus and abort */
+#define WATCHDOG_SEC    20
+
+struct simthread {
+  pthread_t th;
+  void (*fn)(void *);
+  void *arg;
+  int node;
+  int cpu;
+};
+
+static __thread int my_node;
+static __thread int my_cpu;
+static __thread bool irq_enabled = true;
+
+static struct simthread threads[64];
+static int nthreads;
+
+unsigned long sim_progress;
+
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *arena, *arena_brk;
+static void *freelist[MAX_ORDER + 1];
+static void *quarantine[QUARANTINE];
+static int qhead;
+
+int sim_cpuid() {
+  return my_cpu;
+}
+
+int sim_nodeid() {
+  return my_node;
+}
+
+void sim_set_cpu(int node, int cpu) {
+  my_node = node;
+  my_cpu = cpu;
+}
+
+void sim_irq_enable() {
+  irq_enabled = true;
+}
+
+void sim_irq_disable() {
+  irq_enabled = false;
+}
+
+bool sim_irq_enabled() {
+  return irq_enabled;
+}
+
+void sim_relax() {
+  sched_yield();
+}
+
+/* wfe, wfi: wake up by irq if enabled */
+void sim_wfe() {
+  if(irq_enabled)
+    sim_irq_poll();
+
+  sim_relax();
+}
+
+unsigned long sim_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+unsigned long usec_to_cycles(unsigned long us) {
+  return us * 1000;
+}
+
+void sim_usleep(int us) {
+  unsigned long end = sim_now() + usec_to_cycles(us);
+
+  while(sim_now() < end)
+    sim_wfe();
+}
+
+int sim_printf(const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  /* log level prefix of vmm_warn() */
+  if(fmt[0] == '\001' && fmt[1])
+    fmt += 2;
+
+  va_start(ap, fmt);
+  n = vprintf(fmt, ap);
+  va_end(ap);
+
+  return n;
+}
+
+void panic(const char *fmt, ...) {
+  va_list ap;
+
+  fflush(stdout);
+  fprintf(stderr, "panic: Node %d cpu %d: ", my_node, my_cpu);
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+
+  fprintf(stderr, "\n");
+
+  abort();
+}
+
+/* hypervisor malloc() returns zeroed memory */
+void *sim_malloc(unsigned int size) {
+  return calloc(1, size);
+}
+
+void *alloc_pages_flags(int order, int aflags) {
+  unsigned long size = (unsigned long)PAGESIZE << order;
+  void *p;
+
+  if(order > MAX_ORDER)
+    return NULL;
+
+  pthread_mutex_lock(&page_lock);
+
+  if((p = freelist[order]) != NULL) {
+    freelist[order] = *(void **)p;
+  } else {
+    arena_brk = (char *)(((unsigned long)arena_brk + size - 1) & ~(size - 1));
+    if(arena_brk + size > arena + ARENA_SIZE)
+      panic("out of simulated memory");
+
+    p = arena_brk;
+    arena_brk += size;
+  }
+
+  pthread_mutex_unlock(&page_lock);
+
+  if(!(aflags & ALLOC_NOZERO))
+    memset(p, 0, size);
+
+  return p;
+}
+
+void free_pages(void *p, int order) {
+  if(!p || (unsigned long)p % PAGESIZE)
+    panic("free_pages %p", p);
+
+  memset(p, POISON, (unsigned long)PAGESIZE << order);
+
+  pthread_mutex_lock(&page_lock);
+
+  if(order == 0) {
+    void *old = quarantine[qhead];
+
+    quarantine[qhead] = p;
+    qhead = (qhead + 1) % QUARANTINE;
+    p = old;
+  }
+
+  if(p) {
+    *(void **)p = freelist[order];
+    freelist[order] = p;
+  }
+
+  pthread_mutex_unlock(&page_lock);
+}
+
+void *sim_rwlock_alloc() {
+  pthread_rwlockattr_t attr;
+  pthread_rwlock_t *l = malloc(sizeof(*l));
+
+  /* tlb flush must not starve behind guest accesses */
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(l, &attr);
+
+  return l;
+}
+
+void sim_read_lock(void *l) {
+  pthread_rwlock_rdlock(l);
+}
+
+void sim_read_unlock(void *l) {
+  pthread_rwlock_unlock(l);
+}
+
+void sim_write_lock(void *l) {
+  pthread_rwlock_wrlock(l);
+}
+
+void sim_write_unlock(void *l) {
+  pthread_rwlock_unlock(l);
+}
+
+static void dump_stack(int sig) {
+  void *bt[32];
+  int n = backtrace(bt, 32);
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "--- Node %d cpu %d\n", my_node, my_cpu);
+  write(2, buf, strlen(buf));
+  backtrace_symbols_fd(bt, n, 2);
+}
+
+static void *watchdog(void *arg) {
+  unsigned long last = ~0ul;
+
+  for(;;) {
+    sleep(WATCHDOG_SEC);
+
+    if(__atomic_load_n(&sim_progress, __ATOMIC_RELAXED) != last) {
+      last = sim_progress;
+      continue;
+    }
+
+    fprintf(stderr, "vsmsim: no progress for %d sec\n", WATCHDOG_SEC);
+
+    for(int i = 0; i < nthreads; i++) {
+      pthread_kill(threads[i].th, SIGUSR1);
+      sleep(1);
+    }
+
+    abort();
+  }
+
+  return NULL;
+}
+
+static void *thread_main(void *arg) {
+  struct simthread *t = arg;
+
+  sim_set_cpu(t->node, t->cpu);
+
+  t->fn(t->arg);
+
+  return NULL;
+}
+
+void sim_thread_create(void (*fn)(void *), void *arg, int node, int cpu) {
+  struct simthread *t;
+
+  if(nthreads == 64)
+    panic("too many threads");
+
+  t = &threads[nthreads++];
+  t->fn = fn;
+  t->arg = arg;
+  t->node = node;
+  t->cpu = cpu;
+
+  if(pthread_create(&t->th, NULL, thread_main, t))
+    panic("pthread_create");
+}
+
+void sim_thread_join_all() {
+  for(int i = 0; i < nthreads; i++)
+    pthread_join(threads[i].th, NULL);
+
+  nthreads = 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-n nodes] [-c vcpus] [-p pages] [-o accesses] [-w write%%]\n"
+          "          [-q seq%%] [-h hot%%] [-a affine%%] [-m mine%%] [-r seed] [-l usec]\n"
+          "          [-d drop%%] [-L usec [-i usec]] [-b usec] [-t] [-s] [-v]\n"
+          "  -n  nodes (1-4)                  default 2\n"
+          "  -c  vcpus per node               default 2\n"
+          "  -p  guest pages per node         default 64\n"
+          "  -o  accesses per vcpu            default 20000\n"
+          "  -w  %% of writes                  default 20\n"
+          "  -q  %% of sequential read runs    default 5\n"
+          "  -h  %% of accesses to hot pages   default 25\n"
+          "  -a  %% of writes to next node     default 0\n"
+          "  -m  %% of writes to own node      default 0\n"
+          "  -r  random seed                  default 1\n"
+          "  -l  wire latency in usec          default 5\n"
+          "  -d  %% of async replies lost      default 0\n"
+          "  -L  read lease in usec            default 0 (no lease)\n"
+          "  -i  read only usec before lease   default 0\n"
+          "  -b  64KB run broken for usec      default 0\n"
+          "  -t  complete zero copy tx at next irq, not on send\n"
+          "  -s  spread requests of nodes over vcpus, not only vcpu 0\n"
+          "  -v  dump vsm stat of each node\n", prog);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  struct sim_config cfg = {
+    .nnode = 2,
+    .ncpu = 2,
+    .npages = 64,
+    .nops = 20000,
+    .write = 20,
+    .seq = 5,
+    .hot = 25,
+    .seed = 1,
+    .latency = 5,
+  };
+  pthread_t wd;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:c:p:o:w:q:h:a:m:r:l:d:L:i:b:tsv")) != -1) {
+    switch(opt) {
+      case 'n': cfg.nnode = atoi(optarg); break;
+      case 'c': cfg.ncpu = atoi(optarg); break;
+      case 'p': cfg.npages = atoi(optarg); break;
+      case 'o': cfg.nops = atol(optarg); break;
+      case 'w': cfg.write = atoi(optarg); break;
+      case 'q': cfg.seq = atoi(optarg); break;
+      case 'h': cfg.hot = atoi(optarg); break;
+      case 'a': cfg.affine = atoi(optarg); break;
+      case 'm': cfg.mine = atoi(optarg); break;
+      case 'r': cfg.seed = strtoul(optarg, NULL, 0); break;
+      case 'l': cfg.latency = atoi(optarg); break;
+      case 'd': cfg.drop = atoi(optarg); break;
+      case 'L': cfg.lease = atoi(optarg); break;
+      case 'i': cfg.lease_idle = atoi(optarg); break;
+      case 'b': cfg.cont_break = atoi(optarg); break;
+      case 't': cfg.txlate = 1; break;
+      case 's': cfg.spread = 1; break;
+      case 'v': cfg.verbose = 1; break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  if(cfg.write + cfg.seq > 100)
+    usage(argv[0]);
+
+  arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(arena == MAP_FAILED)
+    panic("mmap");
+  arena_brk = arena;
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  signal(SIGUSR1, dump_stack);
+  pthread_create(&wd, NULL, watchdog, NULL);
+
+  return sim_run(&cfg);
+}
@@ -0,0 +1,80 @@
+#ifndef CORE_AARCH64_H
+#define CORE_AARCH64_H
+
+/*
+ *  host replacement of include/aarch64.h for vsmsim
+ *  cpu and irq state belong to the simulated cpu (thread), see sim.h
+ */
+
+#include "types.h"
+#include "compiler.h"
+
+#define HPFAR_FIPA_MASK   0xffffffffffful
+
+#define MPIDR_AFFINITY_LEVEL0(m)    ((m) & 0xff)
+#define MPIDR_AFFINITY_LEVEL1(m)    (((m) >> 8) & 0xff)
+#define MPIDR_AFFINITY_LEVEL2(m)    (((m) >> 16) & 0xff)
+#define MPIDR_AFFINITY_LEVEL3(m)    (((m) >> 32) & 0xff)
+
+#define __cacheline_aligned   __aligned(64)
+
+#define PAR_ADDR(par)         ((par) & 0xfffffffff000)
+
+/* no system registers on host */
+#define read_sysreg(reg)          ((u64)0)
+#define write_sysreg(reg, val)    ((void)(val))
+#define do_at_trans(addr, _at)    ((void)(addr))
+
+int sim_cpuid(void);
+void sim_irq_enable(void);
+void sim_irq_disable(void);
+bool sim_irq_enabled(void);
+void sim_wfe(void);
+
+static inline int cpuid() {
+  return sim_cpuid();
+}
+
+#define intr_enable()         sim_irq_enable()
+#define intr_disable()        sim_irq_disable()
+
+#define local_irq_enable()    sim_irq_enable()
+#define local_irq_disable()   sim_irq_disable()
+
+#define isb()     __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define dsb(ty)   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* take pending messages like an irq would wake up the cpu */
+#define wfi()     sim_wfe()
+#define wfe()     sim_wfe()
+
+#define sev()     ((void)0)
+#define sevl()    ((void)0)
+
+static inline bool local_irq_enabled() {
+  return sim_irq_enabled();
+}
+
+static inline bool local_irq_disabled() {
+  return !sim_irq_enabled();
+}
+
+static inline u64 __irqsave() {
+  u64 flags = sim_irq_enabled();
+
+  sim_irq_disable();
+
+  return flags;
+}
+
+static inline void __irqrestore(u64 flags) {
+  if(flags)
+    sim_irq_enable();
+  else
+    sim_irq_disable();
+}
+
+#define irqsave(flags)      do { flags = __irqsave(); } while(0)
+#define irqrestore(flags)   __irqrestore(flags)
+
+#endif
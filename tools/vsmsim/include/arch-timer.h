@@ -0,0 +1,33 @@
+#ifndef DRIVER_ARCH_TIMER_H
+#define DRIVER_ARCH_TIMER_H
+
+/* host replacement of include/arch-timer.h for vsmsim: 1 cycle = 1 ns */
+
+#include "types.h"
+#include "aarch64.h"
+
+void usleep(int us);
+u64 usec_to_cycles(u64 us);
+
+u64 sim_now(void);
+
+static inline u64 now_cycles() {
+  return sim_now();
+}
+
+/* vcpus poll irq between guest accesses (sim_irq_poll()): no timer */
+enum hyp_timer_slot {
+  HYP_TIMER_MSG,
+  HYP_TIMER_LEASE,
+  NR_HYP_TIMER,
+};
+
+static inline void hyp_timer_arm(enum hyp_timer_slot slot, u64 deadline) {
+  ;
+}
+
+static inline void hyp_timer_disarm(enum hyp_timer_slot slot) {
+  ;
+}
+
+#endif
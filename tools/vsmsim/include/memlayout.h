@@ -0,0 +1,12 @@
+#ifndef CORE_MEMLAYOUT_H
+#define CORE_MEMLAYOUT_H
+
+/*
+ *  host replacement of include/memlayout.h for vsmsim
+ *  simulated physical memory is host memory: pa == va
+ */
+
+#define V2P(va)               ((u64)(va))
+#define P2V(pa)               ((void *)(u64)(pa))
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+/* host replacement of include/spinlock.h for vsmsim */
+
+#include "aarch64.h"
+#include "types.h"
+#include "log.h"
+#include "panic.h"
+
+typedef u8 spinlock_t;
+
+#define spinlock_init(lk) (*(lk) = 0)
+#define SPINLOCK_INIT     0
+
+#define spin_lock_irqsave(lk, flags)  \
+  do {    \
+    flags = __spin_lock_irqsave(lk);    \
+  } while(0)
+
+#define spin_unlock_irqrestore(lk, flags)   \
+  do {    \
+    __spin_unlock_irqrestore(lk, flags);    \
+  } while(0)
+
+static inline void spin_lock(spinlock_t *lk) {
+  while(__atomic_exchange_n(lk, 1, __ATOMIC_ACQUIRE))
+    wfe();
+}
+
+static inline void spin_unlock(spinlock_t *lk) {
+  __atomic_store_n(lk, 0, __ATOMIC_RELEASE);
+}
+
+static inline u64 __spin_lock_irqsave(spinlock_t *lk) {
+  u64 flags;
+
+  irqsave(flags);
+
+  spin_lock(lk);
+
+  return flags;
+}
+
+static inline void __spin_unlock_irqrestore(spinlock_t *lk, u64 flags) {
+  spin_unlock(lk);
+
+  irqrestore(flags);
+}
+
+#endif    /* SPINLOCK_H */
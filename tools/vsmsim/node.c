@@ -0,0 +1,28 @@
+/*
+ *  glue of node SIM_NODE, linked with its copy of core/vsm.c:
+ *  both are built with sim-node.h, so localnode and vsm_* here are the node's
+ */
+
+#include "types.h"
+#include "localnode.h"
+#include "node.h"
+#include "vsm.h"
+#include "sim.h"
+
+struct localnode localnode;
+
+static const struct sim_node_ops ops = {
+  .read_fetch = vsm_read_fetch_page,
+  .write_fetch = vsm_write_fetch_page,
+  .node_init = vsm_node_init,
+  .statdump = vsm_statdump,
+  .set_lease = vsm_set_lease,
+  .lease_expire = vsm_lease_expire,
+};
+
+static void __attribute__((constructor)) sim_node_register() {
+  localnode.nodeid = SIM_NODE;
+  localnode.node = &cluster[SIM_NODE];
+
+  simnode[SIM_NODE].ops = &ops;
+}
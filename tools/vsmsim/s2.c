@@ -0,0 +1,454 @@
+/*
+ *  stage 2 of simulated nodes: a flat level 3 table per node over
+ *  the guest ram of the cluster, and a software tlb per vcpu.
+ *
+ *  guest accesses go through the tlb, so a stage 2 change the protocol
+ *  forgets to flush stays visible to the guest as on hardware.
+ *  a tlb flush waits for guest accesses in flight on the node.
+ */
+
+#include "types.h"
+#include "aarch64.h"
+#include "mm.h"
+#include "s2mm.h"
+#include "allocpage.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "lib.h"
+#include "log.h"
+#include "panic.h"
+#include "assert.h"
+#include "sim.h"
+
+static spinlock_t s2_cont_lock = SPINLOCK_INIT;
+
+u64 *s2_walk(ipa_t ipa) {
+  if(ipa < SIM_RAM_START || ipa >= sim_ram_end())
+    return NULL;
+
+  return &mysimnode()->pte[(ipa - SIM_RAM_START) >> PAGESHIFT];
+}
+
+/* no block mapping */
+u64 *s2_split_walk(ipa_t ipa) {
+  return s2_walk(ipa);
+}
+
+/* wait while the contiguous run of @pte is made or split, as s2mm.c */
+static u64 s2_pte_stable(u64 *pte) {
+  u64 e = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+  u64 flags;
+
+  if((e & PTE_AF) && !(e & PTE_VALID)) {
+    spin_lock_irqsave(&s2_cont_lock, flags);
+    e = *pte;
+    spin_unlock_irqrestore(&s2_cont_lock, flags);
+  }
+
+  return e;
+}
+
+physaddr_t ipa2pa(ipa_t ipa) {
+  u64 *pte = s2_walk(ipa);
+  u64 e;
+
+  if(!pte || !((e = s2_pte_stable(pte)) & PTE_VALID))
+    return 0;
+
+  return PTE_PA(e) + PAGE_OFFSET(ipa);
+}
+
+u64 *s2_accessible_pte(ipa_t ipa) {
+  assert(PAGE_ALIGNED(ipa));
+
+  u64 *pte = s2_walk(ipa);
+
+  return pte && s2pte_is_accessible(pte) ? pte : NULL;
+}
+
+u64 *s2_rwable_pte(ipa_t ipa) {
+  assert(PAGE_ALIGNED(ipa));
+
+  u64 *pte = s2_walk(ipa);
+
+  return pte && s2pte_is_rwable(pte) ? pte : NULL;
+}
+
+u64 *s2_readable_pte(ipa_t ipa) {
+  assert(PAGE_ALIGNED(ipa));
+
+  u64 *pte = s2_walk(ipa);
+
+  return pte && s2pte_is_readable(pte) ? pte : NULL;
+}
+
+u64 *s2_ro_pte(ipa_t ipa) {
+  assert(PAGE_ALIGNED(ipa));
+
+  u64 *pte = s2_walk(ipa);
+
+  return pte && s2pte_is_ro(pte) ? pte : NULL;
+}
+
+static void s2_free_page(void *page) {
+  free_page(page);
+}
+
+void s2_page_invalidate(ipa_t ipa) {
+  assert(PAGE_ALIGNED(ipa));
+
+  u64 *pte = s2_walk(ipa);
+  if(!pte)
+    panic("no entry");
+
+  u64 pa = PTE_PA(*pte);
+
+  s2_cont_split(pte, ipa);
+  s2pte_invalidate(pte);
+  s2_tlb_gather(ipa, PAGESIZE);
+
+  s2_tlb_gather_free(P2V(pa), s2_free_page);
+}
+
+void s2_page_ro(ipa_t ipa) {
+  assert(PAGE_ALIGNED(ipa));
+
+  u64 *pte = s2_walk(ipa);
+  if(!pte)
+    panic("no entry");
+
+  s2_cont_split(pte, ipa);
+  s2pte_ro(pte);
+  s2_tlb_gather(ipa, PAGESIZE);
+}
+
+void s2_map_page_copyset(ipa_t ipa, physaddr_t pa, u64 copyset) {
+  u64 flags = S2PTE_NORMAL | S2PTE_COPYSET(copyset);
+  u64 *pte = s2_walk(ipa);
+
+  if(!pte)
+    panic("no entry: ipa %p", ipa);
+  if(*pte & PTE_AF)
+    panic("this entry has been used: ipa %p", ipa);
+
+  pte_set_entry(pte, pa, flags);
+}
+
+/* map zeroed guest ram, physically contiguous by 64KB */
+void alloc_guestmem(ipa_t ipa, u64 size) {
+  u64 end = ipa + size;
+  char *p = NULL;
+
+  if(size % PAGESIZE)
+    panic("invalid size");
+
+  for(; ipa < end; ipa += PAGESIZE) {
+    if(ipa % S2_CONT_SIZE == 0 || !p) {
+      p = alloc_pages(4);
+      if(!p)
+        panic("p");
+    }
+
+    u64 *pte = s2_walk(ipa);
+    if(!pte)
+      panic("no entry: ipa %p", ipa);
+
+    pte_set_entry(pte, V2P(p + (ipa % S2_CONT_SIZE)), S2PTE_NORMAL | S2PTE_RW);
+  }
+}
+
+void guest_icache_invalidate(void *p, u64 size) {
+  ;
+}
+
+/* invalidate tlb entries of [start, end) of all vcpus of this node */
+static void sim_tlb_flush_range(struct simnode *node, u64 start, u64 end) {
+  for(int c = 0; c < simcfg.ncpu; c++) {
+    struct sim_tlb_entry *e;
+
+    for(e = node->cpu[c].tlb; e < &node->cpu[c].tlb[SIM_TLB_SIZE]; e++) {
+      if(start <= e->ipa && e->ipa < end)
+        e->ipa = 0;
+    }
+  }
+}
+
+static void tlb_s2_flush_range(u64 ipa, u64 size) {
+  struct simnode *node = mysimnode();
+
+  sim_write_lock(node->tlb_lock);
+  sim_tlb_flush_range(node, ipa, ipa + size);
+  sim_write_unlock(node->tlb_lock);
+}
+
+static inline u64 *s2_cont_head(u64 *pte) {
+  return (u64 *)((u64)pte & ~(S2_CONT_PAGES * sizeof(u64) - 1));
+}
+
+u64 sim_ncont_break;
+
+/* run is broken: hold it open for -b usec so that faults and servers hit it */
+static void s2_cont_broken() {
+  __atomic_fetch_add(&sim_ncont_break, 1, __ATOMIC_RELAXED);
+
+  if(simcfg.cont_break)
+    usleep(simcfg.cont_break);
+}
+
+bool s2_cont_check(ipa_t ipa) {
+  u64 *head = s2_walk(ALIGN_DOWN(ipa, S2_CONT_SIZE));
+  u64 pa, attr;
+
+  if(!head)
+    return false;
+
+  pa = PTE_PA(*head);
+  attr = *head & ~PTE_PA(~0ul);
+
+  if(pa % S2_CONT_SIZE != 0)
+    return false;
+
+  for(int i = 0; i < S2_CONT_PAGES; i++) {
+    if(!s2pte_is_rwable(&head[i]) ||
+       PTE_PA(head[i]) != pa + i * PAGESIZE ||
+       (head[i] & ~PTE_PA(~0ul)) != attr)
+      return false;
+  }
+
+  return true;
+}
+
+bool s2_cont_make(ipa_t ipa) {
+  ipa_t base = ALIGN_DOWN(ipa, S2_CONT_SIZE);
+  u64 *head;
+  u64 flags;
+  int i;
+
+  if(!s2_cont_check(ipa))
+    return false;
+
+  head = s2_walk(base);
+
+  if(*head & S2PTE_CONT)
+    return true;
+
+  spin_lock_irqsave(&s2_cont_lock, flags);
+
+  for(i = 0; i < S2_CONT_PAGES; i++)
+    head[i] &= ~PTE_VALID;
+
+  tlb_s2_flush_range(base, S2_CONT_SIZE);
+  s2_cont_broken();
+
+  for(i = 0; i < S2_CONT_PAGES; i++)
+    head[i] |= S2PTE_CONT | PTE_VALID;
+
+  spin_unlock_irqrestore(&s2_cont_lock, flags);
+
+  return true;
+}
+
+void s2_cont_split(u64 *pte, ipa_t ipa) {
+  u64 *head;
+  u64 flags;
+  int i;
+
+  if(!(*pte & S2PTE_CONT))
+    return;
+
+  spin_lock_irqsave(&s2_cont_lock, flags);
+
+  if(*pte & S2PTE_CONT) {
+    head = s2_cont_head(pte);
+
+    for(i = 0; i < S2_CONT_PAGES; i++)
+      head[i] &= ~PTE_VALID;
+
+    tlb_s2_flush_range(ALIGN_DOWN(ipa, S2_CONT_SIZE), S2_CONT_SIZE);
+    s2_cont_broken();
+
+    for(i = 0; i < S2_CONT_PAGES; i++)
+      head[i] = (head[i] & ~S2PTE_CONT) | PTE_VALID;
+  }
+
+  spin_unlock_irqrestore(&s2_cont_lock, flags);
+}
+
+void s2_tlb_gather(ipa_t ipa, u64 size) {
+  struct sim_gather *g = &mysimcpu()->gather;
+  u64 end = ipa + size;
+  int i;
+
+  if(g->all)
+    return;
+
+  for(i = 0; i < g->nrange; i++) {
+    if(ipa <= g->range[i].end && g->range[i].start <= end) {
+      g->range[i].start = min(g->range[i].start, ipa);
+      g->range[i].end = max(g->range[i].end, end);
+      return;
+    }
+  }
+
+  if(g->nrange == SIM_GATHER_NRANGE) {
+    g->all = true;
+    return;
+  }
+
+  g->range[g->nrange].start = ipa;
+  g->range[g->nrange].end = end;
+  g->nrange++;
+}
+
+void s2_tlb_gather_free(void *page, void (*free)(void *)) {
+  struct sim_gather *g = &mysimcpu()->gather;
+
+  if(g->nfree == SIM_GATHER_NFREE)
+    s2_tlb_flush_gathered();
+
+  g->freed[g->nfree].page = page;
+  g->freed[g->nfree].free = free;
+  g->nfree++;
+}
+
+void s2_tlb_flush_gathered() {
+  struct simnode *node = mysimnode();
+  struct sim_gather *g = &mysimcpu()->gather;
+  int i;
+
+  if(g->all || g->nrange > 0) {
+    sim_write_lock(node->tlb_lock);
+
+    if(g->all) {
+      sim_tlb_flush_range(node, 0, ~0ul);
+    } else {
+      for(i = 0; i < g->nrange; i++)
+        sim_tlb_flush_range(node, g->range[i].start, g->range[i].end);
+    }
+
+    sim_write_unlock(node->tlb_lock);
+  }
+
+  g->all = false;
+  g->nrange = 0;
+
+  for(i = 0; i < g->nfree; i++)
+    g->freed[i].free(g->freed[i].page);
+
+  g->nfree = 0;
+}
+
+static inline bool pte_permits(u64 pte, bool wr) {
+  if(!(pte & PTE_AF) || (pte & PTE_V) != PTE_V)
+    return false;
+
+  return wr ? (pte & S2PTE_S2AP_MASK) == S2PTE_RW : !!(pte & S2PTE_RO);
+}
+
+static inline struct sim_tlb_entry *tlb_entry(struct simcpu *c, ipa_t ipa) {
+  return &c->tlb[(ipa >> PAGESHIFT) % SIM_TLB_SIZE];
+}
+
+/*
+ *  walk stage 2 and cache the translation;
+ *  an entry with contiguous hint may serve the whole 64KB run
+ */
+static void tlb_fill(struct simcpu *c, ipa_t ipa) {
+  u64 pte = __atomic_load_n(s2_walk(ipa), __ATOMIC_ACQUIRE);
+
+  if(!pte_permits(pte, false))
+    return;
+
+  if(pte & S2PTE_CONT) {
+    ipa_t base = ALIGN_DOWN(ipa, S2_CONT_SIZE);
+    u64 pa = PTE_PA(pte) - (ipa - base);
+    u64 attr = pte & ~PTE_PA(~0ul);
+
+    for(int i = 0; i < S2_CONT_PAGES; i++) {
+      struct sim_tlb_entry *e = tlb_entry(c, base + i * PAGESIZE);
+
+      e->ipa = base + i * PAGESIZE;
+      e->pte = (pa + i * PAGESIZE) | attr;
+    }
+  } else {
+    struct sim_tlb_entry *e = tlb_entry(c, ipa);
+
+    e->ipa = ipa;
+    e->pte = pte;
+  }
+}
+
+/*
+ *  guest access to u64 at @ipa: a read, or an atomic increment if @wr;
+ *  take stage 2 faults until it is permitted.  return the value read/written
+ */
+u64 sim_guest_access(ipa_t ipa, bool wr) {
+  struct simnode *node = mysimnode();
+  struct simcpu *c = mysimcpu();
+  ipa_t page_ipa = PAGE_ADDRESS(ipa);
+  struct sim_tlb_entry *e = tlb_entry(c, page_ipa);
+  u64 *p, v;
+
+  if(!s2_walk(page_ipa))
+    panic("guest access out of ram %p", ipa);
+
+  for(;;) {
+    sim_read_lock(node->tlb_lock);
+
+    if(e->ipa != page_ipa)
+      tlb_fill(c, page_ipa);
+
+    if(e->ipa == page_ipa && pte_permits(e->pte, wr)) {
+      p = P2V(PTE_PA(e->pte) + PAGE_OFFSET(ipa));
+
+      if(wr)
+        v = __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+      else
+        v = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+
+      sim_read_unlock(node->tlb_lock);
+
+      __atomic_fetch_add(&sim_progress, 1, __ATOMIC_RELAXED);
+
+      if(wr)
+        c->nwrite++;
+      else
+        c->nread++;
+
+      return v;
+    }
+
+    /* a translation that faults is not cached */
+    if(e->ipa == page_ipa)
+      e->ipa = 0;
+
+    sim_read_unlock(node->tlb_lock);
+
+    if(wr) {
+      c->nwfault++;
+      p = node->ops->write_fetch(page_ipa);
+    } else {
+      c->nrfault++;
+      p = node->ops->read_fetch(page_ipa);
+    }
+
+    if(!p)
+      panic("fault on %p resolved to no page", page_ipa);
+
+    /* stage 2 updates of this fault must be visible before the guest resumes */
+    s2_tlb_flush_gathered();
+  }
+}
+
+void sim_s2_init() {
+  int order = 0;
+
+  /* aligned as a real table: s2_cont_head() rounds pointers */
+  while((PAGESIZE << order) < sim_nr_pages() * sizeof(u64))
+    order++;
+
+  for(int n = 0; n < simcfg.nnode; n++) {
+    simnode[n].pte = alloc_pages(order);
+    simnode[n].tlb_lock = sim_rwlock_alloc();
+  }
+}
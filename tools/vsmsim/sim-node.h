@@ -0,0 +1,52 @@
+#ifndef VSMSIM_SIM_NODE_H
+#define VSMSIM_SIM_NODE_H
+
+/*
+ *  force-included into the copy of core/vsm.c and node.c of node SIM_NODE:
+ *  globals get suffix _node<SIM_NODE> and messages are registered to the node
+ */
+
+#define __sim_cat(a, b)       a##b
+#define __sim_sym(name, n)    __sim_cat(name##_node, n)
+#define sim_sym(name)         __sim_sym(name, SIM_NODE)
+
+#define localnode                 sim_sym(localnode)
+#define vsm_access                sim_sym(vsm_access)
+#define vsm_node_init             sim_sym(vsm_node_init)
+#define vsm_read_fetch_instr      sim_sym(vsm_read_fetch_instr)
+#define vsm_read_fetch_page       sim_sym(vsm_read_fetch_page)
+#define vsm_read_fetch_page_imm   sim_sym(vsm_read_fetch_page_imm)
+#define vsm_write_fetch_page      sim_sym(vsm_write_fetch_page)
+#define vsm_write_fetch_page_imm  sim_sym(vsm_write_fetch_page_imm)
+#define vsm_set_block_fetch       sim_sym(vsm_set_block_fetch)
+#define vsm_set_lease             sim_sym(vsm_set_lease)
+#define vsm_lease_expire          sim_sym(vsm_lease_expire)
+#define vsm_statdump              sim_sym(vsm_statdump)
+#define vsm_statreset             sim_sym(vsm_statreset)
+
+/* guest ram of sim has no kernel image */
+#define VSM_BLOCK_FETCH_KERNEL    0
+
+#include "types.h"
+#include "msg.h"
+#include "objpool.h"
+
+void sim_msg_register(int node, enum msgtype type, u32 hdr_size,
+                      void (*handler)(struct msg *));
+
+#undef DEFINE_POCV2_MSG
+#define DEFINE_POCV2_MSG(ty, hdr_struct, handler)                 \
+  static void __attribute__((constructor)) __sim_msg_##ty(void) { \
+    sim_msg_register(SIM_NODE, ty, sizeof(hdr_struct), handler);  \
+  }
+
+/* no boot time pool setup: objects come from malloc() */
+#undef DEFINE_OBJPOOL
+#define DEFINE_OBJPOOL(_name, type, n)    \
+  struct objpool _name = {                \
+    .name = #_name,                       \
+    .objsize = sizeof(type),              \
+    .nobj = (n),                          \
+  }
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef VSMSIM_SIM_H
+#define VSMSIM_SIM_H
+
+#include "types.h"
+#include "param.h"
+#include "memory.h"
+#include "msg.h"
+#include "simhost.h"
+
+/* copyset is 4 bit */
+#define SIM_NODE_MAX        4
+
+#define SIM_RAM_START       0x40000000ul
+
+#define SIM_TLB_SIZE        256
+
+#define SIM_GATHER_NRANGE   8
+#define SIM_GATHER_NFREE    32
+
+/* entry points of the node's copy of core/vsm.c, see node.c */
+struct sim_node_ops {
+  void *(*read_fetch)(u64 page_ipa);
+  void *(*write_fetch)(u64 page_ipa);
+  void (*node_init)(struct memrange *mem);
+  void (*statdump)(int n);
+  int (*set_lease)(u32 idle_us, u32 lease_us);
+  void (*lease_expire)(void);
+};
+
+/* cached stage 2 translation: pte value when it was walked */
+struct sim_tlb_entry {
+  u64 ipa;
+  u64 pte;
+};
+
+/* stage 2 tlb invalidation deferred until s2_tlb_flush_gathered() */
+struct sim_gather {
+  bool all;
+  int nrange;
+  struct {
+    u64 start;
+    u64 end;
+  } range[SIM_GATHER_NRANGE];
+  int nfree;
+  struct {
+    void *page;
+    void (*free)(void *);
+  } freed[SIM_GATHER_NFREE];
+};
+
+struct simcpu {
+  /* fabric */
+  struct msg_queue recvq;
+  struct msg_pending outstanding[NR_MSG_PENDING];
+  u32 nasync;
+  struct sim_txdone *txdone;
+  bool in_lazyirq;
+
+  /* stage 2 */
+  struct sim_tlb_entry tlb[SIM_TLB_SIZE];
+  struct sim_gather gather;
+
+  /* guest accesses and faults taken */
+  u64 nread;
+  u64 nwrite;
+  u64 nrfault;
+  u64 nwfault;
+};
+
+struct simnode {
+  const struct sim_node_ops *ops;
+  struct msg_data msg_data[NUM_MSG];
+  u32 conid;
+
+  /* stage 2: one level 3 entry per guest page of the cluster */
+  u64 *pte;
+  /* guest accesses (read) vs tlb invalidation (write) */
+  void *tlb_lock;
+
+  struct simcpu cpu[NCPU_MAX];
+};
+
+extern struct simnode simnode[SIM_NODE_MAX];
+extern struct sim_config simcfg;
+
+static inline struct simnode *mysimnode() {
+  return &simnode[sim_nodeid()];
+}
+
+static inline struct simcpu *mysimcpu() {
+  return &mysimnode()->cpu[cpuid()];
+}
+
+static inline u64 sim_nr_pages() {
+  return (u64)simcfg.nnode * simcfg.npages;
+}
+
+static inline u64 sim_ram_end() {
+  return SIM_RAM_START + (sim_nr_pages() << PAGESHIFT);
+}
+
+/* fabric.c */
+void sim_fabric_init(void);
+u64 sim_inflight(void);
+u64 sim_fabric_stat(void);
+
+/* s2.c */
+void sim_s2_init(void);
+u64 sim_guest_access(ipa_t ipa, bool wr);
+extern u64 sim_ncont_break;
+
+/* vsmsim.c */
+u32 sim_rand(void);
+
+#endif
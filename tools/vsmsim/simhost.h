@@ -0,0 +1,54 @@
+#ifndef VSMSIM_SIMHOST_H
+#define VSMSIM_SIMHOST_H
+
+/*
+ *  interface between host side (host.c: libc and pthreads) and
+ *  simulated nodes (built with hypervisor headers): plain C types only
+ */
+
+struct sim_config {
+  int nnode;
+  int ncpu;           /* vcpus per node */
+  int npages;         /* guest pages per node */
+  long nops;          /* accesses per vcpu */
+  int write;          /* % of writes */
+  int seq;            /* % of sequential read runs */
+  int hot;            /* % of accesses to hot pages */
+  int affine;         /* % of writes to pages homed on next node */
+  int mine;           /* % of writes to pages homed on own node */
+  int spread;         /* requests go to cpu (src % ncpu), not only cpu 0 */
+  int latency;        /* one way wire latency in usec */
+  int drop;           /* % of replies to async requests lost */
+  int txlate;         /* tx completion of zero copy bodies at next irq, not on send */
+  int lease;          /* read lease in usec, 0: no lease */
+  int lease_idle;     /* read only for this long before leased, usec */
+  int cont_break;     /* usec a contiguous run stays broken while made or split */
+  unsigned long seed;
+  int verbose;
+};
+
+int sim_run(struct sim_config *cfg);
+
+/* simulated cpu of calling thread */
+int sim_nodeid(void);
+void sim_set_cpu(int node, int cpu);
+
+void sim_thread_create(void (*fn)(void *), void *arg, int node, int cpu);
+void sim_thread_join_all(void);
+
+/* give host cpu to other simulated cpus */
+void sim_relax(void);
+
+void *sim_rwlock_alloc(void);
+void sim_read_lock(void *lock);
+void sim_read_unlock(void *lock);
+void sim_write_lock(void *lock);
+void sim_write_unlock(void *lock);
+
+/* completed guest accesses, for watchdog */
+extern unsigned long sim_progress;
+
+/* take pending messages of this cpu (fabric.c) */
+void sim_irq_poll(void);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ *  simulate a cluster running core/vsm.c in one process
+ *
+ *  every vcpu runs random reads and atomic increments on guest pages,
+ *  then the cluster is checked for coherence:
+ *    - reads of a page by a vcpu never go back
+ *    - no increment is lost
+ *    - at the end each page has one owner, and copies only in its copyset
+ */
+
+#include "types.h"
+#include "param.h"
+#include "aarch64.h"
+#include "arch-timer.h"
+#include "localnode.h"
+#include "node.h"
+#include "mm.h"
+#include "s2mm.h"
+#include "allocpage.h"
+#include "malloc.h"
+#include "lib.h"
+#include "log.h"
+#include "panic.h"
+#include "objpool.h"
+#include "vsm-lat.h"
+#include "sim.h"
+
+/* hot pages are spread over all nodes */
+#define SIM_HOT_PAGES     8
+#define SIM_SEQ_RUN       8
+
+struct simnode simnode[SIM_NODE_MAX];
+struct sim_config simcfg;
+
+struct cluster_node cluster[NODE_MAX];
+int nr_cluster_nodes;
+
+struct sim_vcpu {
+  int node;
+  int cpu;
+  u64 *last;      /* last value seen per page */
+};
+
+static u64 *expected;   /* increments per page */
+static u64 nerror;
+static u64 ndone;
+static bool stop;
+static u64 drain_until;
+
+static __thread u64 rand_state;
+
+static u64 lat_count[NR_VSM_LAT];
+static u64 lat_sum[NR_VSM_LAT];
+
+static const char *lat_name[NR_VSM_LAT] = {
+  [LAT_READ_LOCAL]    "read local",
+  [LAT_READ_2HOP]     "read 2hop",
+  [LAT_READ_3HOP]     "read 3hop",
+  [LAT_WRITE_LOCAL]   "write local",
+  [LAT_WRITE_2HOP]    "write 2hop",
+  [LAT_WRITE_3HOP]    "write 3hop",
+  [LAT_INV_FANOUT]    "inv fan-out",
+  [LAT_READ_SERVER]   "read server",
+  [LAT_WRITE_SERVER]  "write server",
+  [LAT_INV_SERVER]    "inv server",
+  [LAT_LEASE_SERVER]  "lease server",
+  [LAT_MANAGER_SERVER] "manager server",
+};
+
+u32 sim_rand() {
+  u64 x = rand_state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rand_state = x;
+
+  return x >> 32;
+}
+
+void *objpool_alloc(struct objpool *pool) {
+  return malloc(pool->objsize);
+}
+
+void objpool_free(struct objpool *pool, void *obj) {
+  free(obj);
+}
+
+void vsm_logging(int type, int src, int dst, u64 ipa, u32 connid, u32 latency) {
+  ;
+}
+
+void vsm_lat_record(enum vsm_lat kind, u64 cycles) {
+  __atomic_fetch_add(&lat_count[kind], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&lat_sum[kind], cycles, __ATOMIC_RELAXED);
+}
+
+static void sim_error(const char *msg, u64 i, u64 a, u64 b) {
+  if(__atomic_fetch_add(&nerror, 1, __ATOMIC_RELAXED) < 16)
+    printf("vsmsim: Node %d cpu %d: page %lx %s: %lu %lu\n", sim_nodeid(), cpuid(),
+           SIM_RAM_START + (i << PAGESHIFT), msg, a, b);
+}
+
+static inline u64 page_ipa(u64 i) {
+  return SIM_RAM_START + (i << PAGESHIFT);
+}
+
+static u64 pick_page(struct sim_vcpu *v, bool wr) {
+  /* page used by one node but managed by another */
+  if(wr && sim_rand() % 100 < simcfg.affine)
+    return (u64)((v->node + 1) % simcfg.nnode) * simcfg.npages + sim_rand() % simcfg.npages;
+
+  /* pages stay home and keep their 64KB runs: reads of other nodes split them */
+  if(wr && sim_rand() % 100 < simcfg.mine)
+    return (u64)v->node * simcfg.npages + sim_rand() % simcfg.npages;
+
+  if(sim_rand() % 100 < simcfg.hot)
+    return sim_rand() % SIM_HOT_PAGES * (sim_nr_pages() / SIM_HOT_PAGES);
+
+  return sim_rand() % sim_nr_pages();
+}
+
+static void read_page(struct sim_vcpu *v, u64 i) {
+  u64 val = sim_guest_access(page_ipa(i), false);
+
+  if(val < v->last[i])
+    sim_error("read goes back", i, v->last[i], val);
+
+  v->last[i] = val;
+}
+
+static void access_one(struct sim_vcpu *v) {
+  u32 r = sim_rand() % 100;
+  u64 i;
+
+  if(r < simcfg.seq) {
+    /* drives prefetch */
+    i = sim_rand() % sim_nr_pages();
+
+    for(int k = 0; k < SIM_SEQ_RUN; k++)
+      read_page(v, (i + k) % sim_nr_pages());
+  } else if(r < simcfg.seq + simcfg.write) {
+    i = pick_page(v, true);
+
+    v->last[i] = sim_guest_access(page_ipa(i), true);
+
+    __atomic_fetch_add(&expected[i], 1, __ATOMIC_RELAXED);
+  } else {
+    read_page(v, pick_page(v, false));
+  }
+}
+
+/* read all pages back after every vcpu finished */
+static void verify(struct sim_vcpu *v) {
+  for(u64 i = 0; i < sim_nr_pages(); i++) {
+    u64 val = sim_guest_access(page_ipa(i), false);
+
+    if(val != expected[i])
+      sim_error("lost update", i, expected[i], val);
+  }
+}
+
+static void vcpu_main(void *arg) {
+  struct sim_vcpu *v = arg;
+  u64 nvcpu = simcfg.nnode * simcfg.ncpu;
+
+  rand_state = simcfg.seed ^ ((u64)(v->node * NCPU_MAX + v->cpu + 1) * 0x9e3779b97f4a7c15);
+
+  for(long n = 0; n < simcfg.nops; n++) {
+    /* irq between guest instructions */
+    sim_irq_poll();
+
+    access_one(v);
+  }
+
+  __atomic_fetch_add(&ndone, 1, __ATOMIC_SEQ_CST);
+
+  if(v->node == 0 && v->cpu == 0) {
+    while(__atomic_load_n(&ndone, __ATOMIC_SEQ_CST) < nvcpu) {
+      sim_irq_poll();
+      sim_relax();
+    }
+
+    verify(v);
+
+    /* leased copies are dropped only by their holder */
+    drain_until = now_cycles() + usec_to_cycles(simcfg.lease);
+    __atomic_store_n(&stop, true, __ATOMIC_SEQ_CST);
+  }
+
+  /* serve other nodes until the fabric is quiet and leases ran out */
+  while(!__atomic_load_n(&stop, __ATOMIC_SEQ_CST) || sim_inflight() != 0 ||
+        now_cycles() < drain_until || mysimcpu()->nasync) {
+    sim_irq_poll();
+    sim_relax();
+  }
+}
+
+/* quiescent cluster: one owner per page, copies in its copyset and up to date */
+static void check_copies() {
+  for(u64 i = 0; i < sim_nr_pages(); i++) {
+    int owner = -1, nowner = 0;
+    u64 *opte = NULL;
+
+    for(int n = 0; n < simcfg.nnode; n++) {
+      u64 *pte = &simnode[n].pte[i];
+
+      if(s2pte_is_accessible(pte) &&
+         (s2pte_is_rwable(pte) || (s2pte_is_ro(pte) && s2pte_copyset(pte) != 0))) {
+        owner = n;
+        opte = pte;
+        nowner++;
+      }
+    }
+
+    if(nowner != 1) {
+      sim_error("owners", i, nowner, owner);
+      continue;
+    }
+
+    for(int n = 0; n < simcfg.nnode; n++) {
+      u64 *pte = &simnode[n].pte[i];
+
+      if(!s2pte_is_accessible(pte))
+        continue;
+
+      if(*(u64 *)P2V(PTE_PA(*pte)) != expected[i])
+        sim_error("stale copy", i, n, *(u64 *)P2V(PTE_PA(*pte)));
+
+      if(n == owner)
+        continue;
+
+      if(s2pte_is_rwable(opte))
+        sim_error("copy of writable page", i, n, owner);
+      else if(!(s2pte_copyset(opte) & (1 << n)))
+        sim_error("copy not in copyset", i, n, s2pte_copyset(opte));
+    }
+  }
+}
+
+static void report(u64 t) {
+  u64 nacc = 0, nfault = 0, nmsg;
+  int n, c;
+
+  printf("vsmsim: %d nodes x %d vcpus, %d pages/node, write %d%% seq %d%% hot %d%%, "
+         "latency %d us%s\n", simcfg.nnode, simcfg.ncpu, simcfg.npages, simcfg.write,
+         simcfg.seq, simcfg.hot, simcfg.latency, simcfg.spread ? ", spread" : "");
+  if(simcfg.affine)
+    printf("%d%% of writes to pages homed on next node\n", simcfg.affine);
+  if(simcfg.mine)
+    printf("%d%% of writes to pages homed on own node\n", simcfg.mine);
+  if(simcfg.lease)
+    printf("read lease %d us after %d us read only\n", simcfg.lease, simcfg.lease_idle);
+  if(simcfg.cont_break)
+    printf("64KB runs broken %lu times for %d us each\n", sim_ncont_break, simcfg.cont_break);
+
+  for(n = 0; n < simcfg.nnode; n++) {
+    u64 r = 0, w = 0, rf = 0, wf = 0;
+
+    for(c = 0; c < simcfg.ncpu; c++) {
+      struct simcpu *sc = &simnode[n].cpu[c];
+
+      r += sc->nread;
+      w += sc->nwrite;
+      rf += sc->nrfault;
+      wf += sc->nwfault;
+    }
+
+    printf("Node %d: read %lu write %lu, read fault %lu write fault %lu\n", n, r, w, rf, wf);
+
+    nacc += r + w;
+    nfault += rf + wf;
+  }
+
+  printf("messages:\n");
+  nmsg = sim_fabric_stat();
+
+  printf("faults resolved:\n");
+  for(int k = 0; k < NR_VSM_LAT; k++) {
+    if(lat_count[k])
+      printf("  %-12s %10lu avg %lu ns\n", lat_name[k], lat_count[k],
+             lat_sum[k] / lat_count[k]);
+  }
+
+  printf("%lu accesses in %lu ms: %lu accesses/s, %lu faults, %lu.%02lu msgs/fault\n",
+         nacc, t / 1000000, t ? nacc * 1000000000 / t : 0, nfault,
+         nfault ? nmsg / nfault : 0, nfault ? nmsg * 100 / nfault % 100 : 0);
+}
+
+int sim_run(struct sim_config *cfg) {
+  struct sim_vcpu *vcpus;
+  int n, c;
+  u64 t0, t;
+
+  simcfg = *cfg;
+
+  if(simcfg.nnode < 1 || simcfg.nnode > SIM_NODE_MAX)
+    panic("nodes: 1-%d", SIM_NODE_MAX);
+  if(simcfg.ncpu < 1 || simcfg.ncpu > NCPU_MAX)
+    panic("vcpus per node: 1-%d", NCPU_MAX);
+  if(simcfg.npages < S2_CONT_PAGES || simcfg.npages % S2_CONT_PAGES ||
+     sim_nr_pages() > GVM_MEMORY / PAGESIZE)
+    panic("pages per node: multiple of %d, up to %d in total", S2_CONT_PAGES,
+          GVM_MEMORY / PAGESIZE);
+
+  nr_cluster_nodes = simcfg.nnode;
+
+  for(n = 0; n < simcfg.nnode; n++) {
+    cluster[n].nodeid = n;
+    cluster[n].mem.start = SIM_RAM_START + ((u64)n * simcfg.npages << PAGESHIFT);
+    cluster[n].mem.size = (u64)simcfg.npages << PAGESHIFT;
+    cluster[n].nvcpu = simcfg.ncpu;
+
+    if(!simnode[n].ops)
+      panic("Node %d is not built in", n);
+  }
+
+  sim_s2_init();
+  sim_fabric_init();
+
+  for(n = 0; n < simcfg.nnode; n++) {
+    sim_set_cpu(n, 0);
+    simnode[n].ops->node_init(&cluster[n].mem);
+
+    if(simnode[n].ops->set_lease(simcfg.lease_idle, simcfg.lease) < 0)
+      panic("lease %d us too short", simcfg.lease);
+  }
+
+  expected = malloc(sim_nr_pages() * sizeof(u64));
+  memset(expected, 0, sim_nr_pages() * sizeof(u64));
+
+  vcpus = malloc(sizeof(*vcpus) * simcfg.nnode * simcfg.ncpu);
+
+  t0 = now_cycles();
+
+  for(n = 0; n < simcfg.nnode; n++) {
+    for(c = 0; c < simcfg.ncpu; c++) {
+      struct sim_vcpu *v = &vcpus[n * simcfg.ncpu + c];
+
+      v->node = n;
+      v->cpu = c;
+      v->last = malloc(sim_nr_pages() * sizeof(u64));
+      memset(v->last, 0, sim_nr_pages() * sizeof(u64));
+
+      sim_thread_create(vcpu_main, v, n, c);
+    }
+  }
+
+  sim_thread_join_all();
+
+  t = now_cycles() - t0;
+
+  sim_set_cpu(0, 0);
+  check_copies();
+
+  report(t);
+
+  if(simcfg.verbose) {
+    for(n = 0; n < simcfg.nnode; n++) {
+      sim_set_cpu(n, 0);
+      simnode[n].ops->statdump(8);
+    }
+  }
+
+  printf("coherence: %s (%lu errors)\n", nerror ? "FAIL" : "ok", nerror);
+
+  return nerror ? 1 : 0;
+}